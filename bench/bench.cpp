@@ -0,0 +1,239 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "../src/interpreter.hpp"
+#include "../src/compiler.hpp"
+#include "../src/vm.hpp"
+
+/* The benchmarks: every workload in bench/workloads on both engines,
+ * and then the parts that everything else is built on by themselves.
+ * Each result is one line of JSON on stdout, so it can be compared between builds:
+ *     {"bench":"fib","engine":"vm","runs":5,"median_ms":12.3,"min_ms":12.1}
+ * The microbenchmarks also have "ns_per_op".
+ *
+ * Usage: bench_runner [--runs N] [--filter NAME] WORKLOAD_DIR
+ * (`make bench` runs it on bench/workloads.)
+ */
+
+namespace fs = std::filesystem;
+using clock_type = std::chrono::steady_clock;
+
+/* So the compiler can't throw away what's being measured. */
+static volatile int64_t sink;
+
+static size_t runs = 5;
+
+struct Timing {
+	double median_ms, min_ms;
+};
+
+/* Runs `f` a few times and takes the median, after one warmup run. */
+static Timing measure(const std::function<void()>& f){
+	f();
+	std::vector<double> times;
+	for(size_t i = 0; i < runs; i++){
+		const auto start = clock_type::now();
+		f();
+		times.push_back(std::chrono::duration<double, std::milli>(clock_type::now() - start).count());
+	}
+	std::sort(times.begin(), times.end());
+	return { times[times.size() / 2], times[0] };
+}
+
+/* `str` as the inside of a JSON string. */
+static std::string json(std::string_view str){
+	std::string res;
+	for(const char c : str){
+		switch(c){
+			case '"': res += "\\\""; break;
+			case '\\': res += "\\\\"; break;
+			case '\n': res += "\\n"; break;
+			case '\t': res += "\\t"; break;
+			default:
+				if(static_cast<unsigned char>(c) < 0x20){
+					char esc[8];
+					snprintf(esc, sizeof(esc), "\\u%04x", c);
+					res += esc;
+				} else {
+					res += c;
+				}
+		}
+	}
+	return res;
+}
+
+static void report(const std::string& bench, const char *engine, const Timing& t, uint64_t ops = 0){
+	printf("{\"bench\":\"%s\",\"engine\":\"%s\",\"runs\":%zu,\"median_ms\":%.4f,\"min_ms\":%.4f",
+		json(bench).c_str(), json(engine).c_str(), runs, t.median_ms, t.min_ms);
+	if(ops != 0) printf(",\"ns_per_op\":%.3f", t.median_ms * 1e6 / ops);
+	printf("}\n");
+	fflush(stdout);
+}
+
+static std::string readFile(const fs::path& path){
+	std::ifstream in(path, std::ios::binary);
+	std::stringstream ss;
+	ss << in.rdbuf();
+	return ss.str();
+}
+
+// Workloads {{{
+/* The time to run an already checked program, without the Lexer, Parser or Compiler.
+ * The output's thrown away (but still formatted). */
+static void workload(const std::string& name, const std::string& src){
+	Lexer lexer(src);
+	Parser parser(lexer.output);
+	TypeChecker checker(*parser.output, lexer.id_num);
+	Compiler compiler(*parser.output, checker);
+	std::ostream null(nullptr);
+	std::istringstream no_input;
+	report(name, "tree-walk", measure([&]{
+		Env env(no_input, null);
+		parser.run(env);
+	}));
+	report(name, "vm", measure([&]{
+		Env env(no_input, null);
+		VM vm(compiler.output, env);
+		vm.run();
+	}));
+}
+// }}}
+
+// Microbenchmarks {{{
+static void lexer(const std::string& corpus){
+	report("lexer", "micro", measure([&]{
+		Lexer lexer(corpus);
+		sink = lexer.output.size();
+	}), corpus.size());
+}
+
+/* Each workload on its own, since they can't be one program.
+ * Per token, since it's given the tokens. */
+static void parser(const std::vector<std::string>& srcs){
+	std::vector<std::unique_ptr<Lexer>> lexers;
+	size_t tokens = 0;
+	for(const auto& src : srcs){
+		lexers.push_back(std::make_unique<Lexer>(src));
+		tokens += lexers.back()->output.size();
+	}
+	constexpr int REPEAT = 200;
+	report("parser", "micro", measure([&]{
+		for(int i = 0; i < REPEAT; i++)
+		for(const auto& lexer : lexers){
+			Parser parser(lexer->output);
+			sink = parser.output->stmts.size();
+		}
+	}), tokens * REPEAT);
+}
+
+static void fraction(){
+	constexpr int N = 1000000;
+	// small denominators, so it never overflows
+	report("fraction_add", "micro", measure([]{
+		Fraction<> s(0);
+		for(int i = 0; i < N; i++){
+			s += Fraction<>(i & 15, 4);
+			if(s > 1000) s -= 1000;
+		}
+		sink = s > 500;
+	}), N);
+	report("fraction_mul", "micro", measure([]{
+		Fraction<> s(1);
+		for(int i = 0; i < N; i += 2){
+			const int k = (i & 15) + 1;
+			s *= Fraction<>(k, k + 1);
+			s *= Fraction<>(k + 1, k);
+		}
+		sink = s == 1;
+	}), N);
+	report("fraction_cmp", "micro", measure([]{
+		int64_t less = 0;
+		for(int i = 0; i < N; i++){
+			less += Fraction<>(i & 31, 3) < Fraction<>(i & 15, 7);
+		}
+		sink = less;
+	}), N);
+}
+
+static void env(){
+	constexpr int N = 10000000;
+	std::ostream null(nullptr);
+	std::istringstream no_input;
+	Env env(no_input, null);
+	env.init(4, 4);
+	for(uint32_t i = 0; i < 4; i++){
+		env.declare(i, EType(Primitive::INTEGER), EValue(int64_t(i)));
+	}
+	env.value({ Slot::Frame::LOCAL, 0 }) = int64_t(0);
+	const Slot slots[] = {
+		{ Slot::Frame::LOCAL, 0 },
+		{ Slot::Frame::GLOBAL, 1 },
+		{ Slot::Frame::GLOBAL_CHECKED, 2 },
+		{ Slot::Frame::GLOBAL, 3 }
+	};
+	report("env_value", "micro", measure([&]{
+		for(int i = 0; i < N; i++){
+			EValue& v = env.value(slots[i & 3]);
+			v.i64 += i;
+		}
+		sink = env.value(slots[0]).i64;
+	}), N);
+}
+// }}}
+
+int main(int argc, char *argv[]){
+	std::string dir, filter;
+	for(int i = 1; i < argc; i++){
+		if(strcmp(argv[i], "--runs") == 0 && i + 1 < argc){
+			runs = std::max(1, atoi(argv[++i]));
+		} else if(strcmp(argv[i], "--filter") == 0 && i + 1 < argc){
+			filter = argv[++i];
+		} else {
+			dir = argv[i];
+		}
+	}
+	if(dir.empty()){
+		std::cerr << "Usage: " << argv[0] << " [--runs N] [--filter NAME] WORKLOAD_DIR\n";
+		return 1;
+	}
+	const auto wanted = [&](const std::string& name){
+		return filter.empty() || name.find(filter) != std::string::npos;
+	};
+
+	std::vector<fs::path> files;
+	for(const auto& file : fs::directory_iterator(dir)){
+		if(file.path().extension() == ".pcse") files.push_back(file.path());
+	}
+	std::sort(files.begin(), files.end());
+	std::vector<std::string> srcs;
+	std::string corpus;
+	for(const auto& path : files){
+		srcs.push_back(readFile(path));
+		corpus += srcs.back() + '\n';
+	}
+
+	for(size_t i = 0; i < files.size(); i++){
+		const std::string name = files[i].stem().string();
+		if(!wanted(name)) continue;
+		try {
+			workload(name, srcs[i]);
+		} catch(std::exception& e){
+			printf("{\"bench\":\"%s\",\"error\":\"%s\"}\n", json(name).c_str(), json(e.what()).c_str());
+		}
+	}
+	// the corpus is small, so lex it a few times over
+	std::string big;
+	for(int i = 0; i < 50; i++) big += corpus;
+	if(wanted("lexer")) lexer(big);
+	if(wanted("parser")) parser(srcs);
+	if(wanted("fraction")) fraction();
+	if(wanted("env")) env();
+}
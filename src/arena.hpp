@@ -0,0 +1,91 @@
+#ifndef ARENA_HPP
+#define ARENA_HPP
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+#include <utility>
+#include <vector>
+
+/* A bump allocator.
+ * Allocating is just moving a pointer along a chunk,
+ * and everything in it gets freed at once when the Arena is destroyed.
+ * Destructors are NOT run, so anything put in here
+ * can't own memory from outside of it (use ArenaVec instead of std::vector). */
+class Arena {
+	struct Chunk {
+		Chunk *prev;
+	};
+	static constexpr size_t CHUNK_SIZE = 64 * 1024;
+	Chunk *last = nullptr;
+	char *ptr = nullptr, *end = nullptr;
+
+	void grow(size_t size){
+		const size_t chunk_size = std::max(CHUNK_SIZE, size + alignof(std::max_align_t) + sizeof(Chunk));
+		Chunk *chunk = static_cast<Chunk *>(std::malloc(chunk_size));
+		if(chunk == nullptr) throw std::bad_alloc();
+		chunk->prev = last;
+		last = chunk;
+		ptr = reinterpret_cast<char *>(chunk) + sizeof(Chunk);
+		end = reinterpret_cast<char *>(chunk) + chunk_size;
+	}
+public:
+	Arena() = default;
+	Arena(const Arena&) = delete;
+	Arena& operator=(const Arena&) = delete;
+	~Arena(){
+		while(last != nullptr){
+			Chunk *prev = last->prev;
+			std::free(last);
+			last = prev;
+		}
+	}
+	inline void *allocate(size_t size, size_t align){
+		size_t pad = -reinterpret_cast<uintptr_t>(ptr) & (align - 1);
+		if(ptr == nullptr || size + pad > static_cast<size_t>(end - ptr)){
+			grow(size + align);
+			pad = -reinterpret_cast<uintptr_t>(ptr) & (align - 1);
+		}
+		void *res = ptr + pad;
+		ptr += pad + size;
+		return res;
+	}
+	/* Only the most recent allocation can actually be given back,
+	 * which is enough for a growing vector to reuse its old space. */
+	inline void deallocate(void *p, size_t size) noexcept {
+		if(static_cast<char *>(p) + size == ptr){
+			ptr = static_cast<char *>(p);
+		}
+	}
+	template<typename T, typename... Args>
+	inline T *make(Args&&... args){
+		return new (allocate(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+	}
+};
+
+/* So standard containers can live in an Arena. */
+template<typename T>
+struct ArenaAllocator {
+	using value_type = T;
+	Arena *arena;
+	ArenaAllocator(Arena& arena_) noexcept : arena(&arena_) {}
+	template<typename U>
+	ArenaAllocator(const ArenaAllocator<U>& other) noexcept : arena(other.arena) {}
+	inline T *allocate(size_t n){
+		return static_cast<T *>(arena->allocate(n * sizeof(T), alignof(T)));
+	}
+	inline void deallocate(T *p, size_t n) noexcept {
+		arena->deallocate(p, n * sizeof(T));
+	}
+	template<typename U>
+	bool operator==(const ArenaAllocator<U>& other) const noexcept { return arena == other.arena; }
+	template<typename U>
+	bool operator!=(const ArenaAllocator<U>& other) const noexcept { return arena != other.arena; }
+};
+
+template<typename T>
+using ArenaVec = std::vector<T, ArenaAllocator<T>>;
+
+#endif /* ARENA_HPP */
@@ -0,0 +1,171 @@
+#ifndef BYTECODE_HPP
+#define BYTECODE_HPP
+
+#include <cstdint>
+#include <vector>
+#include <string>
+#include <ostream>
+#include "value.hpp"
+#include "globals.hpp"
+
+/* The bytecode is for a register machine.
+ * Every function (and the top level, which is treated as function 0)
+ * gets a window of registers on the VM's stack, and every instruction
+ * names the registers it reads and writes directly.
+ * Variables live in registers too, so reading one costs nothing.
+ *
+ * Instructions are typed: the compiler knows the type of every expression,
+ * so there is an ADD_I for INTEGERs and an ADD_R for REALs,
+ * and the VM never has to look at an EType in the hot path.
+ *
+ * A BYREF parameter's register holds a pointer to the variable (or array element) it was given,
+ * and is read and written with GETR and SETR.
+ * The VM's stack never moves, so it can point at registers too.
+ */
+
+// Opcode list {{{
+
+// X-Macro again, for the disassembler.
+// Operand meanings are in the comments.
+// R[x] is register x of the current frame, G[x] is global x, K[x] is constant x.
+#define OPCODE_LIST \
+	OPCODE(MOVE) /* R[a] = R[b] */ \
+	OPCODE(LOADK) /* R[a] = K[b] */ \
+	OPCODE(GETG) /* R[a] = G[b] */ \
+	OPCODE(SETG) /* G[a] = R[b] */ \
+	OPCODE(GETGC) /* R[a] = G[b], checking G[b] was declared */ \
+	OPCODE(SETGC) /* G[a] = R[b], checking G[a] was declared */ \
+	OPCODE(DEFG) /* mark G[a] as declared */ \
+	OPCODE(GETR) /* R[a] = *R[b], where R[b] is a reference */ \
+	OPCODE(SETR) /* *R[a] = R[b], same */ \
+	OPCODE(REF) /* R[a] = reference to R[b] */ \
+	OPCODE(REFG) /* R[a] = reference to G[b] */ \
+	OPCODE(REFGC) /* same, checking G[b] was declared */ \
+	OPCODE(ADD_I) /* R[a] = R[b] + R[c] */ \
+	OPCODE(SUB_I) \
+	OPCODE(MUL_I) \
+	OPCODE(DIV_I) /* DIV */ \
+	OPCODE(MOD_I) /* MOD */ \
+	OPCODE(ADD_R) \
+	OPCODE(SUB_R) \
+	OPCODE(MUL_R) \
+	OPCODE(DIV_R) /* / */ \
+	OPCODE(NEG_I) /* R[a] = -R[b] */ \
+	OPCODE(NEG_R) \
+	OPCODE(NOT) /* R[a] = NOT R[b] */ \
+	OPCODE(I2R) /* R[a] = REAL(R[b]) */ \
+	CMP_OPS(I) CMP_OPS(R) CMP_OPS(C) CMP_OPS(B) CMP_OPS(S) CMP_OPS(D) \
+	OPCODE(JMP) /* goto a */ \
+	OPCODE(JT) /* if R[a] goto b */ \
+	OPCODE(JF) /* if NOT R[a] goto b */ \
+	OPCODE(FORPREP_I) /* R[a..a+3] = from, to, step, direction; R[c] = from */ \
+	OPCODE(FORLOOP_I) /* step the loop at R[a]; if it continues, R[c] = counter and goto b */ \
+	OPCODE(FORPREP_R) \
+	OPCODE(FORLOOP_R) \
+	OPCODE(CALL) /* call function b with the c arguments in R[a...], result in R[a] */ \
+	OPCODE(CALLB) /* same, but b is a builtin */ \
+	OPCODE(RET) /* return R[a] */ \
+	OPCODE(RET0) /* return nothing */ \
+	OPCODE(DEFFUN) /* function a is now defined */ \
+	OPCODE(SETDESC) /* array descriptor a has bounds R[b...] */ \
+	OPCODE(NEWARR) /* R[a] = new array with descriptor b */ \
+	OPCODE(CHKARR) /* type check an array with descriptor a against descriptor b */ \
+	OPCODE(COPYARR) /* R[a] = copy of array R[b] with descriptor c (shared until written to) */ \
+	OPCODE(RELEASE) /* the array in R[a] is going out of scope (and is deleted if nothing else has it) */ \
+	OPCODE(SETARR) /* the array variable in R[a] gets array R[b] instead (see Env::replace()) */ \
+	OPCODE(GETIDX) /* R[a] = R[b][R[c]][R[c+1]]... with descriptor d */ \
+	OPCODE(SETIDX) /* R[a][R[b]][R[b+1]]... = R[c] with descriptor d, unsharing R[a] first */ \
+	OPCODE(REFIDX) /* R[a] = reference to R[b][R[c]][R[c+1]]... with descriptor d, unsharing and pinning R[b] */ \
+	OPCODE(UNPIN) /* unpin the last a arrays pinned by REFIDX */ \
+	OPCODE(INPUT) /* INPUT R[a] as primitive b */ \
+	OPCODE(OUTPUT) /* OUTPUT R[a] as primitive b */ \
+	OPCODE(NEWLINE) \
+	OPCODE(THROW) /* throw error message b (a = 0 for RuntimeError, 1 for TypeError) */ \
+	OPCODE(LINE) /* only with --profile: line a starts (or carries on after a call, if b = 1) */ \
+	OPCODE(HALT)
+
+/* The comparisons, one set per type.
+ * I = INTEGER, R = REAL, C = CHAR, B = BOOLEAN, S = STRING, D = DATE.
+ * > and >= are < and <= with the operands swapped. */
+#define CMP_OPS(t) \
+	OPCODE(EQ_##t) /* R[a] = R[b] = R[c] */ \
+	OPCODE(NE_##t) \
+	OPCODE(LT_##t) \
+	OPCODE(LE_##t)
+
+enum class Op : uint8_t {
+#define OPCODE(x) x,
+	OPCODE_LIST
+#undef OPCODE
+};
+
+const std::vector<std::string_view> op_names = {
+#define OPCODE(x) #x,
+	OPCODE_LIST
+#undef OPCODE
+};
+
+inline std::string_view opName(const Op op) noexcept {
+	return op_names[static_cast<int>(op)];
+}
+
+// }}}
+
+// Instr, Chunk {{{
+
+struct Instr {
+	Op op;
+	uint32_t a = 0, b = 0, c = 0, d = 0;
+	Instr(Op op_, uint32_t a_ = 0, uint32_t b_ = 0, uint32_t c_ = 0, uint32_t d_ = 0):
+		op(op_), a(a_), b(b_), c(c_), d(d_) {}
+};
+
+/* A compiled function. Prototype 0 is the top level. */
+struct Proto {
+	uint32_t entry = 0; /* index of the first instruction */
+	uint32_t frame_size = 0; /* how many registers it needs */
+	uint32_t arity = 0; /* the arguments are the first registers of the frame */
+};
+
+/* Array bounds are expressions that are evaluated when the DECLARE
+ * (or FUNCTION, for parameters) runs, so they can't be known at compile time.
+ * Each place an array type is written down gets a descriptor;
+ * the VM fills the bounds in with SETDESC. */
+struct ArrDesc {
+	Primitive primtype;
+	uint32_t rank;
+};
+
+struct Chunk {
+	std::vector<Instr> code;
+	std::vector<EValue> constants;
+	std::vector<uint32_t> str_constants; /* which constants are string literals, for the cache */
+	std::vector<Proto> protos;
+	std::vector<ArrDesc> descs;
+	std::vector<const EFunc *> builtins;
+	std::vector<std::string> messages; /* for THROW */
+	uint32_t global_count = 0; /* the globals are the first registers of the top level */
+	StringStore strings; /* what the string constants point to, and their characters */
+
+	// friend operator<< {{{
+	/* Disassembles the chunk. */
+	friend std::ostream& operator<<(std::ostream& os, const Chunk& chunk){
+		for(size_t p = 0; p < chunk.protos.size(); p++){
+			const Proto& proto = chunk.protos[p];
+			os << "proto " << p << ": entry " << proto.entry
+				<< ", frame " << proto.frame_size
+				<< ", arity " << proto.arity << '\n';
+		}
+		for(size_t i = 0; i < chunk.code.size(); i++){
+			const Instr& ins = chunk.code[i];
+			os << i << '\t' << opName(ins.op) << '\t'
+				<< ins.a << ' ' << ins.b << ' ' << ins.c << ' ' << ins.d << '\n';
+		}
+		return os;
+	}
+	// }}}
+};
+
+// }}}
+
+#endif /* BYTECODE_HPP */
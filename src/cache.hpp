@@ -0,0 +1,393 @@
+#ifndef CACHE_HPP
+#define CACHE_HPP
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "bytecode.hpp"
+#include "environment.hpp"
+#include "globals.hpp"
+#include "mapped_file.hpp"
+
+/* Compiled programs, saved to disk so that running an unchanged file again
+ * can skip the Lexer, Parser, TypeChecker and Compiler and go straight to the VM.
+ *
+ * A cache file is just the Chunk dumped as it is in memory (it's only ever read back
+ * by the same build on the same machine), except for the parts that point elsewhere:
+ * string literals are written out, and builtins are written by name.
+ * The file name is a hash of the source and the format, so an edited file or a pcse
+ * with a different bytecode just misses the cache, and old entries are never read again.
+ * The hash is only for finding the file: the whole source is in it too,
+ * and it's only used if that's the same, so two sources with the same hash can't mix up.
+ *
+ * Running a cached Chunk means trusting whoever wrote it: the VM doesn't know what type
+ * a register holds, so a file made up to use a number as an array or a reference
+ * could make it read and write anywhere. So a file is only read if nobody but the current user
+ * could have written it: the directory and the file both have to be owned by them,
+ * neither can be writable by the group or anyone else, and neither is followed if it's a symlink.
+ * Anything else is a miss (and isn't written to either). Without the POSIX calls
+ * to check that (on Windows), there's no cache at all.
+ *
+ * That still leaves files that are truncated or damaged some other way,
+ * so every instruction is checked before the Chunk is used (see verify()).
+ * That catches a damaged file, not one that was made to lie, which is why it has to be trusted first.
+ * A miss is just a recompile, so anything odd is a miss.
+ */
+
+namespace cache {
+
+/* Change this whenever what a Chunk means changes in a way the layout() doesn't catch
+ * (an opcode's operands, how the compiler uses registers, ...). */
+constexpr std::string_view version = "pcse-cache 2";
+constexpr char magic[8] = { 'P', 'C', 'S', 'E', 'C', 'H', 'N', 'K' };
+
+// FNV-1a
+inline uint64_t hash(std::string_view str, uint64_t h = 0xcbf29ce484222325){
+	for(const char c : str){
+		h = (h ^ (unsigned char)c) * 0x100000001b3;
+	}
+	return h;
+}
+
+/* The opcodes and the sizes of what's dumped as it is in memory.
+ * A build that numbers the opcodes differently, or lays Chunks out differently, gets a different one,
+ * without making every rebuild of the same code throw the cache away. */
+inline uint64_t layout(){
+	uint64_t h = hash(version);
+	for(const std::string_view name : op_names){
+		h = hash(name, hash(" ", h));
+	}
+	const uint64_t sizes[] = { sizeof(Instr), sizeof(Proto), sizeof(ArrDesc), sizeof(EValue), sizeof(void *) };
+	return hash(std::string_view(reinterpret_cast<const char *>(sizes), sizeof(sizes)), h);
+}
+
+/* Where the compiled form of `src` would be. */
+inline std::string path(const std::string& dir, std::string_view src){
+	char name[32];
+	snprintf(name, sizeof(name), "%016llx.pcsec", (unsigned long long)hash(src, layout()));
+	return dir + '/' + name;
+}
+
+// Trust {{{
+#ifdef PCSE_HAVE_MMAP
+/* Whether `fd` is owned by us and nobody else can write to it. */
+inline bool trusted(int fd){
+	struct stat st;
+	return fstat(fd, &st) == 0 && st.st_uid == geteuid() && (st.st_mode & (S_IWGRP | S_IWOTH)) == 0;
+}
+
+/* `filename` split into the directory (opened, if it can be trusted; -1 otherwise) and the name in it. */
+inline int openDir(const std::string& filename, std::string& name){
+	const size_t slash = filename.rfind('/');
+	const std::string dir = (slash == std::string::npos) ? "." : filename.substr(0, slash + (slash == 0));
+	name = filename.substr(slash + 1);
+	const int fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+	if(fd >= 0 && !trusted(fd)){
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+#endif
+// }}}
+
+// Writing {{{
+class Writer {
+	std::string buf;
+public:
+	template<typename T>
+	inline void raw(const T *data, size_t n){
+		// keep everything aligned, so the Reader can copy straight out of the mmap
+		buf.append(reinterpret_cast<const char *>(data), n * sizeof(T));
+		buf.append(-buf.size() & 7, '\0');
+	}
+	inline void u64(uint64_t x){ raw(&x, 1); }
+	inline void str(std::string_view s){
+		u64(s.size());
+		raw(s.data(), s.size());
+	}
+	template<typename T>
+	inline void vec(const std::vector<T>& v){
+		u64(v.size());
+		raw(v.data(), v.size());
+	}
+	inline const std::string& output() const noexcept { return buf; }
+};
+
+inline std::string serialize(const Chunk& chunk, std::string_view src){
+	Writer w;
+	w.raw(magic, sizeof(magic));
+	w.str(version);
+	w.u64(layout());
+	w.str(src);
+	w.u64(chunk.global_count);
+	w.vec(chunk.code);
+	w.vec(chunk.protos);
+	w.vec(chunk.descs);
+	w.vec(chunk.constants);
+	w.vec(chunk.str_constants);
+	for(const uint32_t k : chunk.str_constants){
+		w.str(chunk.constants[k].str);
+	}
+	w.u64(chunk.messages.size());
+	for(const auto& msg : chunk.messages){
+		w.str(msg);
+	}
+	w.u64(chunk.builtins.size());
+	for(const EFunc *func : chunk.builtins){
+		for(const auto& f : builtin::global_funcs){
+			if(&f.second == func) w.str(f.first);
+		}
+	}
+	return w.output();
+}
+
+/* Saves a compiled `src`. It's written to a temporary file first and then renamed,
+ * so someone else running the same file at the same time never sees half of it.
+ * Failing to write is fine, the cache is just missed next time. */
+inline void store(const std::string& filename, const Chunk& chunk, std::string_view src){
+#ifdef PCSE_HAVE_MMAP
+	std::string name;
+	const int dir = openDir(filename, name);
+	if(dir < 0) return;
+	const std::string data = serialize(chunk, src);
+	const std::string tmp = name + ".tmp" + std::to_string(std::random_device{}());
+	// Not writable by anyone else, or load() won't trust it.
+	const int fd = openat(dir, tmp.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW, 0644);
+	if(fd >= 0){
+		bool ok = true;
+		for(size_t done = 0; ok && done < data.size();){
+			const ssize_t n = write(fd, data.data() + done, data.size() - done);
+			if(n < 0 && errno == EINTR) continue;
+			ok = n > 0;
+			done += ok ? n : 0;
+		}
+		if(close(fd) != 0) ok = false;
+		if(!ok || renameat(dir, tmp.c_str(), dir, name.c_str()) != 0) unlinkat(dir, tmp.c_str(), 0);
+	}
+	close(dir);
+#else
+	(void)filename, (void)chunk, (void)src;
+#endif
+}
+// }}}
+
+// Reading {{{
+/* Anything wrong with the file (it's truncated, from another version, ...)
+ * makes `ok` false, and it's treated as a miss. */
+class Reader {
+	const char *curr, *end;
+public:
+	bool ok = true;
+	Reader(std::string_view data) : curr(data.data()), end(data.data() + data.size()) {}
+	template<typename T>
+	inline void raw(T *out, size_t n){
+		const size_t size = n * sizeof(T);
+		if(!ok || size > static_cast<size_t>(end - curr)){
+			ok = false;
+			return;
+		}
+		std::memcpy(static_cast<void *>(out), curr, size);
+		curr += size;
+		curr += std::min<size_t>(-size & 7, end - curr);
+	}
+	inline uint64_t u64(){
+		uint64_t x = 0;
+		raw(&x, 1);
+		return x;
+	}
+	inline std::string_view str(){
+		const uint64_t size = u64();
+		if(!ok || size > static_cast<size_t>(end - curr)){
+			ok = false;
+			return {};
+		}
+		std::string_view res(curr, size);
+		curr += size;
+		curr += std::min<size_t>(-size & 7, end - curr);
+		return res;
+	}
+	/* A count of things that are each at least 8 bytes long, so a bad one can't make us allocate a lot. */
+	inline size_t count(){
+		const uint64_t n = u64();
+		if(n > static_cast<size_t>(end - curr) / 8) ok = false;
+		return ok ? n : 0;
+	}
+	/* `fill` is only there because not everything in a Chunk has a default constructor. */
+	template<typename T>
+	inline void vec(std::vector<T>& v, const T& fill){
+		const uint64_t size = u64();
+		if(!ok || size > static_cast<size_t>(end - curr) / sizeof(T)){
+			ok = false;
+			return;
+		}
+		v.assign(size, fill);
+		raw(v.data(), size);
+	}
+};
+
+/* Whether every instruction of `chunk` only uses registers of its own function's frame,
+ * jumps within that function, and refers to things that exist.
+ * The functions' code comes one after the other (the top level first), and each one has to
+ * end in an instruction that doesn't carry on to the next, so running off the end of one can't
+ * reach code that was checked against a different frame.
+ * (It doesn't check that the registers hold the right types,
+ * which is why only files that nobody else could have written are loaded at all.)
+ * LINE isn't allowed, since a profiled run never uses the cache. */
+inline bool verify(const Chunk& chunk){
+	if(chunk.protos.empty() || chunk.code.empty()) return false;
+	if(chunk.protos[0].frame_size < chunk.global_count) return false;
+	for(const ArrDesc& desc : chunk.descs){
+		if(desc.primtype >= Primitive::INVALID || desc.rank == 0) return false;
+	}
+	// Where each function's code starts and ends.
+	std::vector<std::pair<uint32_t, uint32_t>> ranges; /* (entry, proto) */
+	for(uint32_t p = 0; p < chunk.protos.size(); p++){
+		const Proto& proto = chunk.protos[p];
+		if(proto.entry >= chunk.code.size() || proto.arity > proto.frame_size || proto.frame_size > Env::STACK_SIZE) return false;
+		ranges.push_back({ proto.entry, p });
+	}
+	std::sort(ranges.begin(), ranges.end());
+	if(ranges[0].first != 0) return false;
+	for(size_t r = 0; r < ranges.size(); r++){
+		const uint32_t start = ranges[r].first;
+		const uint32_t end = (r + 1 < ranges.size() ? ranges[r + 1].first : chunk.code.size());
+		if(start == end) return false;
+		const bool top_level = (ranges[r].second == 0);
+		const uint64_t frame = chunk.protos[ranges[r].second].frame_size;
+		/* Registers x to x + n - 1 are all in the frame. */
+		const auto regs = [frame](uint64_t x, uint64_t n = 1){ return x + n <= frame; };
+		const auto target = [start, end](uint32_t x){ return x >= start && x < end; };
+		const auto global = [&chunk](uint32_t x){ return x < chunk.global_count; };
+		const auto desc = [&chunk](uint32_t x){ return x < chunk.descs.size(); };
+		const auto primitive = [](uint32_t x){ return x < static_cast<uint32_t>(Primitive::INVALID); };
+		for(uint32_t pc = start; pc < end; pc++){
+			const Instr& i = chunk.code[pc];
+			bool ok;
+			switch(i.op){
+#define CASE(x) case Op:: x
+#define CMP(t) CASE(EQ_##t): CASE(NE_##t): CASE(LT_##t): CASE(LE_##t):
+				CASE(MOVE): CASE(GETR): CASE(SETR): CASE(REF): CASE(SETARR):
+				CASE(NEG_I): CASE(NEG_R): CASE(NOT): CASE(I2R):
+					ok = regs(i.a) && regs(i.b);
+					break;
+				CASE(ADD_I): CASE(SUB_I): CASE(MUL_I): CASE(DIV_I): CASE(MOD_I):
+				CASE(ADD_R): CASE(SUB_R): CASE(MUL_R): CASE(DIV_R):
+				CMP(I) CMP(R) CMP(C) CMP(B) CMP(S) CMP(D)
+					ok = regs(i.a) && regs(i.b) && regs(i.c);
+					break;
+#undef CMP
+				CASE(LOADK): ok = regs(i.a) && i.b < chunk.constants.size(); break;
+				CASE(GETG): CASE(GETGC): CASE(REFG): CASE(REFGC): ok = regs(i.a) && global(i.b); break;
+				CASE(SETG): CASE(SETGC): ok = global(i.a) && regs(i.b); break;
+				CASE(DEFG): ok = global(i.a); break;
+				CASE(JMP): ok = target(i.a); break;
+				CASE(JT): CASE(JF): ok = regs(i.a) && target(i.b); break;
+				CASE(FORPREP_I): CASE(FORPREP_R): ok = regs(i.a, 4) && regs(i.c); break;
+				CASE(FORLOOP_I): CASE(FORLOOP_R): ok = regs(i.a, 4) && target(i.b) && regs(i.c); break;
+				CASE(CALL):
+					ok = i.b != 0 && i.b < chunk.protos.size() && i.c == chunk.protos[i.b].arity
+						&& regs(i.a, std::max<uint32_t>(i.c, 1));
+					break;
+				CASE(CALLB):
+					ok = i.b < chunk.builtins.size() && i.c == chunk.builtins[i.b]->arity
+						&& regs(i.a, std::max<uint32_t>(i.c, 1));
+					break;
+				/* the top level has nothing to return to */
+				CASE(RET): ok = !top_level && regs(i.a); break;
+				CASE(RET0): ok = !top_level; break;
+				CASE(HALT): ok = true; break;
+				CASE(DEFFUN): ok = i.a != 0 && i.a < chunk.protos.size(); break;
+				CASE(SETDESC): ok = desc(i.a) && regs(i.b, 2 * uint64_t(chunk.descs[i.a].rank)); break;
+				CASE(NEWARR): ok = regs(i.a) && desc(i.b); break;
+				CASE(CHKARR): ok = desc(i.a) && desc(i.b); break;
+				CASE(COPYARR): ok = regs(i.a) && regs(i.b) && desc(i.c); break;
+				CASE(RELEASE): ok = regs(i.a); break;
+				CASE(GETIDX): CASE(REFIDX):
+					ok = regs(i.a) && regs(i.b) && desc(i.d) && regs(i.c, chunk.descs[i.d].rank);
+					break;
+				CASE(SETIDX):
+					ok = regs(i.a) && desc(i.d) && regs(i.b, chunk.descs[i.d].rank) && regs(i.c);
+					break;
+				CASE(UNPIN): ok = true; break; /* the VM checks there are that many */
+				CASE(INPUT): CASE(OUTPUT): ok = regs(i.a) && primitive(i.b); break;
+				CASE(NEWLINE): ok = true; break;
+				CASE(THROW): ok = i.a <= 1 && i.b < chunk.messages.size(); break;
+				default: ok = false; break; /* LINE, or not an opcode at all */
+#undef CASE
+			}
+			if(!ok) return false;
+		}
+		switch(chunk.code[end - 1].op){
+			case Op::JMP: case Op::RET: case Op::RET0: case Op::THROW: case Op::HALT: break;
+			default: return false;
+		}
+	}
+	return true;
+}
+
+/* The opposite of serialize(). Nothing in `chunk` points into `data` afterwards. */
+inline bool deserialize(std::string_view data, std::string_view src, Chunk& chunk){
+	Reader r(data);
+	char file_magic[sizeof(magic)];
+	r.raw(file_magic, sizeof(file_magic));
+	if(!r.ok || std::memcmp(file_magic, magic, sizeof(magic)) != 0) return false;
+	if(r.str() != version || r.u64() != layout() || r.str() != src) return false;
+	const uint64_t global_count = r.u64();
+	if(global_count > Env::STACK_SIZE) return false;
+	chunk.global_count = global_count;
+	r.vec(chunk.code, Instr(Op::HALT));
+	r.vec(chunk.protos, Proto());
+	r.vec(chunk.descs, ArrDesc());
+	r.vec(chunk.constants, EValue());
+	r.vec(chunk.str_constants, 0u);
+	if(!r.ok) return false;
+	for(const uint32_t k : chunk.str_constants){
+		if(k >= chunk.constants.size()) return false;
+		chunk.constants[k].str = chunk.strings.internCopy(r.str());
+	}
+	chunk.messages.resize(r.count());
+	for(auto& msg : chunk.messages){
+		msg = r.str();
+	}
+	chunk.builtins.resize(r.count());
+	for(auto& func : chunk.builtins){
+		auto it = builtin::global_funcs.find(r.str());
+		if(it == builtin::global_funcs.end()) return false;
+		func = &it->second;
+	}
+	return r.ok && verify(chunk);
+}
+
+/* Loads the Chunk for `src` from `filename`, returning false if it isn't there
+ * (or is unusable, or someone else could have written it). */
+inline bool load(const std::string& filename, std::string_view src, Chunk& chunk){
+#ifdef PCSE_HAVE_MMAP
+	std::string name;
+	const int dir = openDir(filename, name);
+	if(dir < 0) return false;
+	const int fd = openat(dir, name.c_str(), O_RDONLY | O_NOFOLLOW);
+	close(dir);
+	if(fd < 0) return false;
+	bool res = false;
+	if(trusted(fd)){
+		const MappedFile file(fd);
+		res = file.ok && deserialize(file.view(), src, chunk);
+	}
+	close(fd);
+	return res;
+#else
+	(void)filename, (void)src, (void)chunk;
+	return false;
+#endif
+}
+// }}}
+
+}
+
+#endif /* CACHE_HPP */
@@ -0,0 +1,852 @@
+#ifndef COMPILER_HPP
+#define COMPILER_HPP
+
+#include <vector>
+#include <string>
+#include "typechecker.hpp"
+#include "bytecode.hpp"
+
+/* Lowers a Program into a Chunk for the VM.
+ * The Program has to have been through the TypeChecker first:
+ * the types of expressions are read from it, and nothing is checked again.
+ * The types of the globals and the functions' signatures come from the TypeChecker too,
+ * and calls use the function numbers it gave them:
+ * PROCEDURE or FUNCTION number n is prototype n + 1, and the builtins come after them.
+ *
+ * Everything the tree-walker figures out at runtime
+ * (which version of + to use, where a value should go) is figured out here, once.
+ * Variables are found using the Slots the TypeChecker gave them:
+ * globals are the first registers of the top level, in slot order,
+ * and locals get whatever register is free when they come into scope.
+ * A BYREF parameter's register has a reference in it instead,
+ * so it's read and written like a global, through another register.
+ */
+
+// Compiler {{{
+
+class Compiler {
+public:
+	Chunk output;
+	/* With `profile`, there's a LINE instruction before every statement for the Profiler. */
+	inline Compiler(const Program& program, const TypeChecker& checker, bool profile_ = false);
+private:
+	struct Function {
+		const TypeChecker::Function *sig;
+		uint32_t proto;
+		/* sig's types, with descriptors for the arrays */
+		std::vector<SType> params;
+		SType ret;
+	};
+	struct Local {
+		uint32_t reg;
+		SType type;
+		bool byref = false;
+	};
+	/* Where a variable lives. */
+	struct Var {
+		enum class Kind {
+			REG, /* in a register of the current frame */
+			GLOBAL, /* a global, seen from inside a function */
+			GLOBAL_CHECKED, /* same, but it might not have been DECLAREd yet */
+			REF /* a BYREF parameter, whose register has a reference to it */
+		} kind;
+		uint32_t index;
+		SType type;
+	};
+	struct Operand {
+		SType type;
+		uint32_t reg;
+	};
+
+	std::vector<SType> globals; /* indexed by slot, with descriptors for the arrays */
+	std::vector<Function> functions; /* by number */
+
+	bool profile;
+	uint32_t curr_line = 0; /* of the statement being compiled */
+
+	// State for the function being compiled.
+	const Function *curr_func = nullptr; /* nullptr for the top level */
+	std::vector<Local> locals; /* indexed by slot */
+	uint32_t top = 0, max_top = 0;
+
+	// Emitting {{{
+	inline uint32_t here() const noexcept {
+		return output.code.size();
+	}
+	inline uint32_t emit(Op op, uint32_t a = 0, uint32_t b = 0, uint32_t c = 0, uint32_t d = 0){
+		output.code.emplace_back(op, a, b, c, d);
+		return here() - 1;
+	}
+	inline uint32_t alloc(uint32_t n = 1){
+		const uint32_t reg = top;
+		top += n;
+		max_top = std::max(max_top, top);
+		return reg;
+	}
+	inline uint32_t constant(const EValue val){
+		output.constants.push_back(val);
+		return output.constants.size() - 1;
+	}
+	inline uint32_t constant(const std::string_view str){
+		output.str_constants.push_back(output.constants.size());
+		return constant(EValue(output.strings.internCopy(str)));
+	}
+	inline uint32_t message(const std::string& msg){
+		output.messages.push_back(msg);
+		return output.messages.size() - 1;
+	}
+	/* A statement on `line` starts here. */
+	inline void startLine(uint32_t line){
+		if(!profile) return;
+		curr_line = line;
+		emit(Op::LINE, line);
+	}
+	inline uint32_t desc(Primitive primtype, uint32_t rank){
+		output.descs.push_back({ primtype, rank });
+		return output.descs.size() - 1;
+	}
+	// }}}
+
+	/* Copies a variable that isn't in a register into `reg`. */
+	inline void load(const Var& var, uint32_t reg){
+		switch(var.kind){
+			case Var::Kind::GLOBAL: emit(Op::GETG, reg, var.index); break;
+			case Var::Kind::GLOBAL_CHECKED: emit(Op::GETGC, reg, var.index); break;
+			default: emit(Op::GETR, reg, var.index); break;
+		}
+	}
+	/* And back. `checked` is whether it's already been loaded, so it must have been declared. */
+	inline void store(const Var& var, uint32_t reg, bool checked = false){
+		switch(var.kind){
+			case Var::Kind::GLOBAL: emit(Op::SETG, var.index, reg); break;
+			case Var::Kind::GLOBAL_CHECKED: emit(checked ? Op::SETG : Op::SETGC, var.index, reg); break;
+			default: emit(Op::SETR, var.index, reg); break;
+		}
+	}
+
+	/* Whether `reg` holds a variable, rather than being a temporary. */
+	inline bool isVar(uint32_t reg) const {
+		if(curr_func == nullptr && reg < output.global_count) return true;
+		for(const Local& local : locals){
+			if(local.reg == reg) return true;
+		}
+		return false;
+	}
+
+	// Type helpers {{{
+	static bool isNumeric(const SType& t) noexcept {
+		return t == Primitive::INTEGER || t == Primitive::REAL;
+	}
+	/* The tree-walker checks array sizes when copying, so we have to do it at runtime. */
+	inline void checkArr(const SType& from, const SType& to){
+		if(from.is_array()){
+			emit(Op::CHKARR, from.desc, to.desc);
+		}
+	}
+	/* The array parameters stop sharing their arrays when the function returns. */
+	inline void releaseParams(){
+		for(size_t i = 0; i < curr_func->params.size(); i++){
+			if(curr_func->params[i].is_array() && !curr_func->sig->byref[i]){
+				emit(Op::RELEASE, locals[i].reg);
+			}
+		}
+	}
+	// }}}
+
+	inline void bounds(const Type& type, uint32_t d);
+	inline Var lookup(const Slot& slot) const;
+	inline uint32_t toReal(const Operand& op);
+
+	template<typename T>
+	inline bool hasCall(const T& e) const;
+
+	// Expressions {{{
+	inline Operand expr(const Expr& e, uint32_t dst, bool alias);
+	inline Operand expr(const Primary& p, uint32_t dst, bool alias);
+	inline Operand lvalue(const LValue& lv, uint32_t dst, bool alias);
+	inline uint32_t indexes(const LValue& lv);
+	inline bool ref(const Expr& e, uint32_t dst, const SType& param);
+	inline Operand call(uint32_t index, const ArenaVec<Expr>& args);
+	/* Compile into a register of the compiler's choosing. */
+	inline Operand exprReg(const Expr& e){
+		return expr(e, alloc(), true);
+	}
+	/* Compile into `dst`. */
+	inline SType exprTo(const Expr& e, uint32_t dst){
+		return expr(e, dst, false).type;
+	}
+	inline void binop(TokenType op, Operand l, Operand r, uint32_t dst);
+	// }}}
+
+	// Statements {{{
+	inline void assign(const LValue& lv, const Expr& e);
+	inline void input(const LValue& lv);
+	template<bool TopLevel>
+	inline void caseof(const Stmt<TopLevel>& s);
+	template<bool TopLevel>
+	inline void forloop(const Stmt<TopLevel>& s);
+	inline void block(const Block& b);
+	template<bool TopLevel>
+	inline void stmt(const Stmt<TopLevel>& s);
+	inline void function(const Function& func);
+	// }}}
+};
+
+// }}}
+
+// Compiler::{bounds, lookup, toReal, hasCall} {{{
+
+/* Evaluates the bounds of an array type into descriptor `d`. */
+inline void Compiler::bounds(const Type& type, uint32_t d){
+	const uint32_t saved = top;
+	const uint32_t base = alloc(2 * output.descs[d].rank);
+	const Type *curr = &type;
+	for(uint32_t i = 0; curr->is_array(); i++, curr = curr->name().rec){
+		exprTo(*curr->start(), base + 2*i);
+		exprTo(*curr->end(), base + 2*i + 1);
+	}
+	emit(Op::SETDESC, d, base);
+	top = saved;
+}
+
+inline Compiler::Var Compiler::lookup(const Slot& slot) const {
+	switch(slot.frame){
+		case Slot::Frame::LOCAL:
+			return { Var::Kind::REG, locals[slot.index].reg, locals[slot.index].type };
+		case Slot::Frame::REF:
+			return { Var::Kind::REF, locals[slot.index].reg, locals[slot.index].type };
+		case Slot::Frame::GLOBAL:
+			return { curr_func == nullptr ? Var::Kind::REG : Var::Kind::GLOBAL, slot.index, globals[slot.index] };
+		default:
+			return { Var::Kind::GLOBAL_CHECKED, slot.index, globals[slot.index] };
+	}
+}
+
+inline uint32_t Compiler::toReal(const Operand& op){
+	if(op.type == Primitive::REAL) return op.reg;
+	const uint32_t reg = alloc();
+	emit(Op::I2R, reg, op.reg);
+	return reg;
+}
+
+/* Whether evaluating `e` could call a function,
+ * which could change any global. */
+template<typename T>
+inline bool Compiler::hasCall(const T& e) const {
+	if constexpr (std::is_same_v<T, Primary>) {
+		switch(e.primtype()){
+			case TokenType::CALL: return true;
+			case TokenType::IDENTIFIER:
+				if(e.main().lvalue.indexes != nullptr){
+					for(const Expr& index : *e.main().lvalue.indexes){
+						if(hasCall(index)) return true;
+					}
+				}
+				return false;
+			default: return false;
+		}
+	} else {
+		switch(e.kind){
+			case Expr::Kind::PRIMARY: return hasCall(*e.primary);
+			case Expr::Kind::UNARY: return hasCall(*e.right);
+			case Expr::Kind::BINARY: return hasCall(*e.left) || hasCall(*e.right);
+		}
+		return false;
+	}
+}
+
+// }}}
+
+// Compiler::{expr, lvalue, indexes, call, binop} {{{
+
+inline Compiler::Operand Compiler::expr(const Expr& e, uint32_t dst, bool alias){
+	if(e.kind == Expr::Kind::PRIMARY) return expr(*e.primary, dst, alias);
+	const uint32_t saved = top;
+	if(e.kind == Expr::Kind::UNARY){
+		const Operand val = expr(*e.right, alloc(), true);
+		if(e.op == TokenType::NOT){
+			emit(Op::NOT, dst, val.reg);
+		} else if(e.op == TokenType::MINUS){
+			emit(val.type == Primitive::INTEGER ? Op::NEG_I : Op::NEG_R, dst, val.reg);
+		} else {
+			throw RuntimeError("Invalid unary expr operator. This should not have happened!");
+		}
+	} else if(e.op == TokenType::AND || e.op == TokenType::OR){
+		// The right side only gets evaluated if the left side doesn't decide it.
+		// If `dst` is a variable, the right side might read it,
+		// so the left side can't go there directly.
+		const uint32_t res = isVar(dst) ? alloc() : dst;
+		exprTo(*e.left, res);
+		const uint32_t jump = here();
+		emit(e.op == TokenType::AND ? Op::JF : Op::JT, res);
+		exprTo(*e.right, res);
+		output.code[jump].b = here();
+		if(res != dst) emit(Op::MOVE, dst, res);
+	} else {
+		// If the right side calls a function, it could change a variable the left side read,
+		// so the left side has to be copied out.
+		const Operand l = expr(*e.left, alloc(), !hasCall(*e.right));
+		const Operand r = expr(*e.right, alloc(), true);
+		binop(e.op, l, r, dst);
+	}
+	top = saved;
+	return { e.type, dst };
+}
+
+inline void Compiler::binop(TokenType op, Operand l, Operand r, uint32_t dst){
+	const int level = binaryLevel(op);
+	if(level == 2) {
+		if(isNumeric(l.type) && isNumeric(r.type) && l.type != r.type){
+			l = { Primitive::REAL, toReal(l) };
+			r = { Primitive::REAL, toReal(r) };
+		}
+		uint32_t base;
+		switch(l.type.primtype){
+#define CASE(x, t) case Primitive:: x: base = static_cast<uint32_t>(Op::EQ_##t); break;
+			CASE(INTEGER, I);
+			CASE(REAL, R);
+			CASE(CHAR, C);
+			CASE(BOOLEAN, B);
+			CASE(STRING, S);
+			CASE(DATE, D);
+#undef CASE
+			default: throw RuntimeError("Invalid types! (INTERNAL ERROR)");
+		}
+		// EQ, NE, LT, LE are in that order for every type.
+		switch(op){
+			case TokenType::EQ: emit(Op(base), dst, l.reg, r.reg); break;
+			case TokenType::LT_GT: emit(Op(base + 1), dst, l.reg, r.reg); break;
+			case TokenType::LT: emit(Op(base + 2), dst, l.reg, r.reg); break;
+			case TokenType::LT_EQ: emit(Op(base + 3), dst, l.reg, r.reg); break;
+			case TokenType::GT: emit(Op(base + 2), dst, r.reg, l.reg); break;
+			case TokenType::GT_EQ: emit(Op(base + 3), dst, r.reg, l.reg); break;
+			default: throw RuntimeError("Invalid operator for comparison expr. (INTERNAL ERROR)");
+		}
+	} else if(level == 3) {
+		const bool is_int = (l.type == Primitive::INTEGER && r.type == Primitive::INTEGER);
+		Op opcode;
+		if(op == TokenType::PLUS) opcode = is_int ? Op::ADD_I : Op::ADD_R;
+		else if(op == TokenType::MINUS) opcode = is_int ? Op::SUB_I : Op::SUB_R;
+		else throw RuntimeError("Invalid operator for +- expr. (INTERNAL ERROR)");
+		if(is_int){
+			emit(opcode, dst, l.reg, r.reg);
+		} else {
+			emit(opcode, dst, toReal(l), toReal(r));
+		}
+	} else {
+		const bool is_int = (l.type == Primitive::INTEGER && r.type == Primitive::INTEGER);
+		switch(op){
+			case TokenType::STAR:
+				if(is_int){
+					emit(Op::MUL_I, dst, l.reg, r.reg);
+				} else {
+					emit(Op::MUL_R, dst, toReal(l), toReal(r));
+				}
+				break;
+			case TokenType::SLASH:
+				emit(Op::DIV_R, dst, toReal(l), toReal(r));
+				break;
+			case TokenType::MOD:
+			case TokenType::DIV:
+				emit(op == TokenType::DIV ? Op::DIV_I : Op::MOD_I, dst, l.reg, r.reg);
+				break;
+			default:
+				throw RuntimeError("Invalid operator for *,/,MOD,DIV expr. (INTERNAL ERROR)");
+		}
+	}
+}
+
+inline Compiler::Operand Compiler::expr(const Primary& p, uint32_t dst, bool alias){
+	const Token::Literal& lt = p.main().lt;
+	switch(p.primtype()){
+#define LITERAL(x, val) \
+		case TokenType:: x: \
+			emit(Op::LOADK, dst, constant(val)); \
+			return { p.type, dst };
+		LITERAL(REAL_C, lt.frac);
+		LITERAL(INT_C, lt.i64);
+		LITERAL(CHAR_C, lt.c);
+		LITERAL(TRUE, true);
+		LITERAL(FALSE, false);
+		LITERAL(DATE_C, lt.date);
+		LITERAL(STR_C, lt.str);
+#undef LITERAL
+		case TokenType::IDENTIFIER:
+			return lvalue(p.main().lvalue, dst, alias);
+		case TokenType::CALL:
+			{
+				const Operand res = call(p.all.func, *p.main().args);
+				if(res.reg != dst) emit(Op::MOVE, dst, res.reg);
+				top = res.reg; // free the call's registers
+				return { res.type, dst };
+			}
+		default:
+			throw RuntimeError("Invalid primary type. (INTERNAL ERROR)");
+	}
+}
+
+/* Compiles the indexes of `lv` into consecutive registers and returns the first. */
+inline uint32_t Compiler::indexes(const LValue& lv){
+	const uint32_t base = alloc(lv.indexes->size());
+	for(size_t i = 0; i < lv.indexes->size(); i++){
+		exprTo((*lv.indexes)[i], base + i);
+	}
+	return base;
+}
+
+inline Compiler::Operand Compiler::lvalue(const LValue& lv, uint32_t dst, bool alias){
+	const Var var = lookup(lv.slot);
+	if(lv.indexes == nullptr){
+		uint32_t reg = dst;
+		if(var.kind == Var::Kind::REG){
+			reg = var.index;
+		} else {
+			load(var, reg);
+		}
+		if(reg != dst && !alias) emit(Op::MOVE, dst, reg);
+		return { var.type, alias ? reg : dst };
+	}
+	const uint32_t saved = top;
+	const uint32_t first = indexes(lv);
+	// An index could call a function that replaces the array, so it's only loaded now.
+	uint32_t arr = var.index;
+	if(var.kind != Var::Kind::REG){
+		arr = alloc();
+		load(var, arr);
+	}
+	emit(Op::GETIDX, dst, arr, first, var.type.desc);
+	top = saved;
+	return { var.type.primtype, dst };
+}
+
+/* Puts a reference to the variable `e` into `dst`, for a BYREF parameter.
+ * Returns whether it's an array element, which pins the array until the call returns. */
+inline bool Compiler::ref(const Expr& e, uint32_t dst, const SType& param){
+	// The TypeChecker made sure it's a variable.
+	const LValue& lv = e.primary->main().lvalue;
+	const Var var = lookup(lv.slot);
+	if(lv.indexes == nullptr){
+		checkArr(var.type, param);
+		switch(var.kind){
+			case Var::Kind::REG: emit(Op::REF, dst, var.index); break;
+			case Var::Kind::GLOBAL: emit(Op::REFG, dst, var.index); break;
+			case Var::Kind::GLOBAL_CHECKED: emit(Op::REFGC, dst, var.index); break;
+			case Var::Kind::REF: emit(Op::MOVE, dst, var.index); break;
+		}
+		return false;
+	}
+	const uint32_t saved = top;
+	const uint32_t first = indexes(lv);
+	// An index could call a function that replaces the array, so it's only loaded now.
+	uint32_t arr = var.index;
+	if(var.kind != Var::Kind::REG){
+		arr = alloc();
+		load(var, arr);
+	}
+	emit(Op::REFIDX, dst, arr, first, var.type.desc);
+	if(var.kind != Var::Kind::REG){
+		// REFIDX might have given it its own copy.
+		store(var, arr, true);
+	}
+	top = saved;
+	return true;
+}
+
+/* Leaves the arguments and result at the top of the frame. */
+inline Compiler::Operand Compiler::call(uint32_t index, const ArenaVec<Expr>& args){
+	const uint32_t base = alloc(std::max<size_t>(args.size(), 1));
+	if(index < functions.size()){
+		const Function& func = functions[index];
+		uint32_t pins = 0;
+		for(size_t i = 0; i < args.size(); i++){
+			if(func.sig->byref[i]){
+				pins += ref(args[i], base + i, func.params[i]);
+				continue;
+			}
+			const SType type = exprTo(args[i], base + i);
+			if(type.is_array()){
+				// Arguments are passed by value.
+				checkArr(type, func.params[i]);
+				if(!args[i].isCall()) emit(Op::COPYARR, base + i, base + i, func.params[i].desc);
+			}
+		}
+		emit(Op::CALL, base, func.proto, args.size());
+		if(profile) emit(Op::LINE, curr_line, 1);
+		if(pins != 0) emit(Op::UNPIN, pins);
+		return { func.ret, base };
+	} else {
+		const uint32_t builtin = index - functions.size();
+		const EFunc& func = *output.builtins.at(builtin);
+		for(size_t i = 0; i < args.size(); i++){
+			exprTo(args[i], base + i);
+		}
+		emit(Op::CALLB, base, builtin, args.size());
+		return { func.ret_type.primtype, base };
+	}
+}
+
+// }}}
+
+// Compiler::{assign, input, caseof, forloop, block, stmt, function} {{{
+
+inline void Compiler::assign(const LValue& lv, const Expr& e){
+	const Var var = lookup(lv.slot);
+	const uint32_t saved = top;
+	SType type = var.type;
+	uint32_t first = 0;
+	if(lv.indexes != nullptr){
+		type = var.type.primtype;
+		first = indexes(lv);
+	}
+	if(type.is_array()){
+		// A whole array. Arrays can't be elements, so there aren't any indexes.
+		const Operand val = expr(e, alloc(), true);
+		checkArr(val.type, type);
+		uint32_t res = val.reg;
+		if(!e.isCall()){
+			res = alloc();
+			emit(Op::COPYARR, res, val.reg, type.desc);
+		}
+		// The call could have changed the variable, so it's only loaded now.
+		uint32_t target = var.index;
+		if(var.kind != Var::Kind::REG){
+			target = alloc();
+			load(var, target);
+		}
+		emit(Op::SETARR, target, res);
+		if(var.kind != Var::Kind::REG) store(var, target, true);
+		top = saved;
+		return;
+	}
+	// Where the value should end up before it gets stored.
+	const uint32_t dst = (lv.indexes == nullptr && var.kind == Var::Kind::REG ? var.index : alloc());
+	const Operand val = expr(e, dst, true);
+	if(type == Primitive::REAL && val.type == Primitive::INTEGER){
+		emit(Op::I2R, dst, val.reg);
+	} else if(val.reg != dst){
+		emit(Op::MOVE, dst, val.reg);
+	}
+	if(lv.indexes != nullptr){
+		// The indexes or the value could call a function that replaces the array,
+		// so it's only loaded now.
+		uint32_t arr = var.index;
+		if(var.kind != Var::Kind::REG){
+			arr = alloc();
+			load(var, arr);
+		}
+		emit(Op::SETIDX, arr, first, dst, var.type.desc);
+		if(var.kind != Var::Kind::REG){
+			// SETIDX might have given it its own copy.
+			store(var, arr, true);
+		}
+	} else if(var.kind != Var::Kind::REG){
+		store(var, dst);
+	}
+	top = saved;
+}
+
+inline void Compiler::input(const LValue& lv){
+	const Var var = lookup(lv.slot);
+	if(lv.indexes == nullptr && var.kind == Var::Kind::REG){
+		emit(Op::INPUT, var.index, static_cast<uint32_t>(var.type.primtype));
+		return;
+	}
+	const uint32_t saved = top;
+	if(lv.indexes != nullptr){
+		const uint32_t first = indexes(lv);
+		// An index could call a function that replaces the array, so it's only loaded now.
+		uint32_t arr = var.index;
+		if(var.kind != Var::Kind::REG){
+			arr = alloc();
+			load(var, arr);
+		}
+		const uint32_t val = alloc();
+		emit(Op::INPUT, val, static_cast<uint32_t>(var.type.primtype));
+		emit(Op::SETIDX, arr, first, val, var.type.desc);
+		if(var.kind != Var::Kind::REG){
+			store(var, arr, true);
+		}
+	} else {
+		const uint32_t val = alloc();
+		emit(Op::INPUT, val, static_cast<uint32_t>(var.type.primtype));
+		store(var, val);
+	}
+	top = saved;
+}
+
+template<bool TopLevel>
+inline void Compiler::caseof(const Stmt<TopLevel>& s){
+	const uint32_t saved = top;
+	// The value is copied, since the cases could call a function that changes it.
+	const Operand val = lvalue(s.lvalues[0], alloc(), false);
+	std::vector<uint32_t> ends;
+	for(size_t i = 0; i < s.exprs.size(); i++){
+		const uint32_t case_saved = top;
+		Operand l = val, r = exprReg(s.exprs[i]);
+		if(l.type != r.type){
+			// INTEGER, REAL or vice versa
+			l = { Primitive::REAL, toReal(l) };
+			r = { Primitive::REAL, toReal(r) };
+		}
+		uint32_t cmp;
+		switch(l.type.primtype){
+#define CASE(x, t) case Primitive:: x: cmp = static_cast<uint32_t>(Op::EQ_##t); break;
+			CASE(INTEGER, I);
+			CASE(REAL, R);
+			CASE(CHAR, C);
+			CASE(BOOLEAN, B);
+			CASE(STRING, S);
+			CASE(DATE, D);
+#undef CASE
+			default: throw TypeError("Use of unassigned type within CASE statement");
+		}
+		const uint32_t res = alloc();
+		emit(Op(cmp), res, l.reg, r.reg);
+		const uint32_t next = emit(Op::JF, res);
+		top = case_saved;
+		block(s.blocks[i]);
+		ends.push_back(emit(Op::JMP));
+		output.code[next].b = here();
+	}
+	if(s.blocks.size() > s.exprs.size()){
+		// the last block is an OTHERWISE
+		block(s.blocks.back());
+	}
+	for(const uint32_t end : ends){
+		output.code[end].a = here();
+	}
+	top = saved;
+}
+
+template<bool TopLevel>
+inline void Compiler::forloop(const Stmt<TopLevel>& s){
+	const uint32_t saved = top;
+	// from, to, step, direction
+	const uint32_t base = alloc(4);
+	SType types[3];
+	bool is_frac = false;
+	for(size_t i = 0; i < s.exprs.size(); i++){
+		types[i] = exprTo(s.exprs[i], base + i);
+		is_frac |= (types[i] == Primitive::REAL);
+	}
+	if(s.exprs.size() == 2){
+		types[2] = Primitive::INTEGER;
+		emit(Op::LOADK, base + 2, constant((int64_t)1));
+	}
+	if(is_frac){
+		for(uint32_t i = 0; i < 3; i++){
+			if(types[i] == Primitive::INTEGER) emit(Op::I2R, base + i, base + i);
+		}
+	}
+	// The loop variable is in scope only inside the loop.
+	const uint32_t var = alloc();
+	emit(is_frac ? Op::FORPREP_R : Op::FORPREP_I, base, 0, var);
+	locals.push_back({ var, is_frac ? Primitive::REAL : Primitive::INTEGER });
+	const uint32_t body = here();
+	block(s.blocks[0]);
+	emit(is_frac ? Op::FORLOOP_R : Op::FORLOOP_I, base, body, var);
+	locals.pop_back();
+	top = saved;
+}
+
+inline void Compiler::block(const Block& b){
+	for(const auto& s : b.stmts){
+		if(s.form == StmtForm::RETURN){
+			startLine(s.line);
+			const uint32_t saved = top;
+			const Operand val = exprReg(s.exprs[0]);
+			checkArr(val.type, curr_func->ret);
+			uint32_t res = val.reg;
+			if(val.type.is_array() && !s.exprs[0].isCall()){
+				// The caller gets its own reference, since the parameters are about to let go of theirs.
+				res = alloc();
+				emit(Op::COPYARR, res, val.reg, curr_func->ret.desc);
+			}
+			releaseParams();
+			emit(Op::RET, res);
+			top = saved;
+			// Anything after this can't run.
+			return;
+		}
+		stmt(s);
+	}
+}
+
+template<bool TopLevel>
+inline void Compiler::stmt(const Stmt<TopLevel>& s){
+	const uint32_t saved = top;
+	startLine(s.line);
+#define CASE(x) case StmtForm:: x
+	if constexpr (TopLevel) {
+		switch(s.form){
+			CASE(DECLARE):
+			CASE(CONSTANT):
+				{
+					const SType& type = globals[s.slot];
+					if(s.form == StmtForm::DECLARE){
+						if(type.is_array()){
+							bounds(s.types[0], type.desc);
+							emit(Op::NEWARR, s.slot, type.desc);
+						} else if(type.primtype == Primitive::STRING){
+							// as a string constant, so the cache doesn't save the pointer
+							emit(Op::LOADK, s.slot, constant(empty_string));
+						} else {
+							emit(Op::LOADK, s.slot, constant(defaultValue(type.primtype)));
+						}
+					} else {
+						exprTo(s.exprs[0], s.slot);
+					}
+					emit(Op::DEFG, s.slot);
+				}
+				return;
+			CASE(PROCEDURE):
+			CASE(FUNCTION):
+				{
+					const Function& func = functions[s.func];
+					for(size_t i = 0; i < s.params.size(); i++){
+						if(func.params[i].is_array()) bounds(s.params[i].type, func.params[i].desc);
+					}
+					if(func.ret.is_array()) bounds(s.types[0], func.ret.desc);
+					emit(Op::DEFFUN, func.proto);
+				}
+				return;
+			default:
+				break;
+		}
+	}
+	switch(s.form){
+		CASE(ASSIGN):
+			assign(s.lvalues[0], s.exprs[0]);
+			break;
+		CASE(INPUT):
+			input(s.lvalues[0]);
+			break;
+		CASE(OUTPUT):
+			for(const Expr& e : s.exprs){
+				const Operand val = exprReg(e);
+				emit(Op::OUTPUT, val.reg, static_cast<uint32_t>(val.type.primtype));
+				top = saved;
+			}
+			emit(Op::NEWLINE);
+			break;
+		CASE(IF):
+			{
+				const Operand cond = exprReg(s.exprs[0]);
+				top = saved;
+				const uint32_t jf = emit(Op::JF, cond.reg);
+				block(s.blocks[0]);
+				if(s.blocks.size() == 2){ // if there is an ELSE statement
+					const uint32_t jmp = emit(Op::JMP);
+					output.code[jf].b = here();
+					block(s.blocks[1]);
+					output.code[jmp].a = here();
+				} else {
+					output.code[jf].b = here();
+				}
+			}
+			break;
+		CASE(CASE):
+			caseof(s);
+			break;
+		CASE(FOR):
+			forloop(s);
+			break;
+		CASE(REPEAT):
+			{
+				const uint32_t start = here();
+				block(s.blocks[0]);
+				const Operand cond = exprReg(s.exprs[0]);
+				emit(Op::JF, cond.reg, start);
+			}
+			break;
+		CASE(WHILE):
+			{
+				const uint32_t start = here();
+				const Operand cond = exprReg(s.exprs[0]);
+				top = saved;
+				const uint32_t jf = emit(Op::JF, cond.reg);
+				block(s.blocks[0]);
+				emit(Op::JMP, start);
+				output.code[jf].b = here();
+			}
+			break;
+		CASE(CALL):
+			{
+				const Operand res = call(s.func, s.exprs);
+				// Nothing else is going to release it.
+				if(res.type.is_array()) emit(Op::RELEASE, res.reg);
+			}
+			break;
+		default:
+			// RETURN is handled in block().
+			throw RuntimeError("Invalid start of statement. (INTERNAL ERROR)");
+	}
+#undef CASE
+	top = saved;
+}
+
+inline void Compiler::function(const Function& func){
+	const Stmt<true>& s = *func.sig->def;
+	Proto& proto = output.protos[func.proto];
+	proto.entry = here();
+	proto.arity = s.params.size();
+	curr_func = &func;
+	locals.clear();
+	top = max_top = 0;
+	for(size_t i = 0; i < s.params.size(); i++){
+		locals.push_back({ alloc(), func.params[i], func.sig->byref[i] });
+	}
+	block(s.blocks[0]);
+	if(func.sig->is_func){
+		// should have returned, but didn't
+		emit(Op::THROW, 1, message("Function didn't return"));
+	} else {
+		releaseParams();
+		emit(Op::RET0);
+	}
+	proto.frame_size = max_top;
+}
+
+// }}}
+
+// Compiler::Compiler {{{
+
+inline Compiler::Compiler(const Program& program, const TypeChecker& checker, bool profile_):
+	profile(profile_)
+{
+	// The functions get their prototypes and descriptors first,
+	// since they can be called from before they are defined.
+	output.protos.emplace_back();
+	output.global_count = program.global_count;
+	for(uint32_t slot = 0; slot < program.global_count; slot++){
+		globals.push_back(checker.global(slot));
+		SType& type = globals.back();
+		if(type.is_array()) type.desc = desc(type.primtype, type.rank);
+	}
+	for(const TypeChecker::Function *sig : checker.definitions()){
+		Function func = { sig, static_cast<uint32_t>(output.protos.size()), sig->params, sig->ret };
+		output.protos.emplace_back();
+		for(SType& type : func.params){
+			if(type.is_array()) type.desc = desc(type.primtype, type.rank);
+		}
+		if(func.ret.is_array()) func.ret.desc = desc(func.ret.primtype, func.ret.rank);
+		functions.push_back(func);
+	}
+	// The builtins are the rest of the function numbers.
+	output.builtins.assign(program.functions.begin() + functions.size(), program.functions.end());
+	// The top level.
+	top = max_top = output.global_count;
+	for(const auto& s : program.stmts){
+		stmt(s);
+	}
+	emit(Op::HALT);
+	output.protos[0].frame_size = max_top;
+	// The functions.
+	for(const Function& func : functions){
+		function(func);
+	}
+}
+
+// }}}
+
+#endif /* COMPILER_HPP */
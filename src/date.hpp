@@ -13,6 +13,8 @@ struct DateError : public std::runtime_error {
 struct Date {
 	uint8_t day, month;
 	uint16_t year;
+	/* Left uninitialized, like an int (so an EValue can be too). */
+	Date() = default;
 	inline Date(uint8_t day_, uint8_t month_, uint16_t year_)
 	: day(day_), month(month_), year(year_) {
 		if(month > 12) throw DateError("Month value too high");
@@ -4,15 +4,20 @@
 #include <cstdint>
 #include <iostream>
 #include <vector>
+#include <deque>
 #include <map>
 #include <memory>
 #include <sstream>
 #include <charconv>
+#include <chrono>
 
 #include "utils.hpp"
 #include "value.hpp"
 #include "globals.hpp"
 #include "error.hpp"
+#include "out_buffer.hpp"
+#include "in_buffer.hpp"
+#include "profiler.hpp"
 
 class EnvError : public std::runtime_error {
 public:
@@ -27,162 +32,333 @@ public:
 
 /* Space for variables and such. */
 class Env {
-private:
-	std::vector<EType> var_types;
-	std::vector<EValue> var_vals;
-	/* This 'var_call_level' thing specifies what _call frame_
-	 * the variable is in. 
-	 * 0 is for global variables, and 1 is the _global_ call frame.
-	 * Any function call, since it creates its own scope, has a _call frame number_
-	 * assigned to it, (>= 2) and its variables are put inside this with that
-	 * call frame number.
-	 * A function cannot access anything except for 0 and its own call number.
-	 */
-	std::vector<int32_t> var_call_level;
 public:
-	// See the above for the call number.
-	int32_t call_number = 1;
+	/* A call frame. The TypeChecker gives every parameter and FOR variable
+	 * a slot in the frame of the function it's in, so a variable is just `base[slot]`.
+	 * The top level has a frame too, for its FOR variables. */
+	struct Frame {
+		EValue *base = nullptr;
+		EValue *end = nullptr;
+		const EFunc *func = nullptr; /* for the types of array parameters; nullptr at the top level */
+	};
+	/* How many values fit on the stack.
+	 * The pages are only touched when they're used, so this can be generous. */
+	static const size_t STACK_SIZE = 1 << 20;
+	/* How deep calls can go, on both engines.
+	 * A call with an empty frame doesn't use any of the stack above, so that can't be the only limit,
+	 * and the tree-walker recurses on the C++ stack, which has to stay well within 8MB (even in a Debug build). */
+	static const size_t MAX_DEPTH = 2000;
+	/* What a program is allowed to use. 0 means no limit. */
+	struct Limits {
+		uint64_t steps = 0; /* loop iterations and function calls */
+		size_t memory = 0; /* bytes of live arrays and STRING input */
+		double seconds = 0;
+	};
+	/* How many steps go by between looking at the clock. */
+	static constexpr uint64_t CHECK_INTERVAL = 1 << 14;
+	/* For --memory-stats. The bytes are the ones counted towards the memory limit. */
+	struct MemoryStats {
+		size_t live_bytes = 0;
+		size_t peak_bytes = 0;
+		size_t arrays = 0; /* how many are live */
+	};
+private:
+	std::vector<EValue> globals;
+	/* The type of each global, which has the bounds of arrays.
+	 * It's INVALID until the global's DECLARE runs. */
+	std::vector<EType> global_types;
+	/* All the call frames, one after the other.
+	 * It never gets reallocated, so references into it stay valid,
+	 * and it's left uninitialized, so the pages are only touched when they're used. */
+	std::unique_ptr<EValue[]> stack;
+	Limits limits;
+	/* step() only counts down, so it's cheap enough to always be on;
+	 * checkLimits() does the real work every `batch` steps. */
+	uint64_t countdown = CHECK_INTERVAL, batch = CHECK_INTERVAL;
+	uint64_t steps_done = 0; /* as of the last checkLimits() */
+	size_t bytes = 0; /* live right now */
+	size_t peak = 0;
+	/* Every array this Env has made that's still around, newest first. */
+	EArray *arrays = nullptr;
+	size_t array_count = 0;
+	std::chrono::steady_clock::time_point deadline;
 
-	const int32_t GLOBAL_LEVEL = 0;
+	inline void nextBatch(){
+		batch = countdown = (limits.steps == 0) ? CHECK_INTERVAL
+			: std::clamp<uint64_t>(limits.steps - std::min(steps_done, limits.steps), 1, CHECK_INTERVAL);
+	}
+	[[gnu::noinline]] void checkLimits(){
+		steps_done += batch;
+		if(limits.steps != 0 && steps_done > limits.steps){
+			throw StepLimitError("Step limit of " + std::to_string(limits.steps) + " exceeded");
+		}
+		if(limits.seconds != 0 && std::chrono::steady_clock::now() > deadline){
+			throw TimeLimitError("Time limit exceeded");
+		}
+		nextBatch();
+	}
+	/* Counts `n` more bytes towards the memory limit. */
+	inline void charge(size_t n){
+		bytes += n;
+		peak = std::max(peak, bytes);
+		if(limits.memory != 0 && bytes > limits.memory){
+			throw MemoryLimitError("Memory limit of " + std::to_string(limits.memory) + " bytes exceeded");
+		}
+	}
+	/* For memory that's been given back. */
+	inline void uncharge(size_t n) noexcept {
+		bytes -= std::min(bytes, n);
+	}
+public:
+	Frame frame;
+	size_t depth = 0; /* how many PROCEDUREs and FUNCTIONs are running (see MAX_DEPTH) */
 	
-	std::map<int64_t, EFunc> functable;
+	/* Every function by its number (see Program::functions).
+	 * A PROCEDURE or FUNCTION is nullptr until its definition runs. */
+	std::vector<const EFunc *> functable;
+	std::deque<EFunc> defs; /* the PROCEDUREs and FUNCTIONs that have been defined (a deque, so they don't move) */
 	
 	size_t line_number = 1;
 
-	inline bool checkLevel(int64_t var) const noexcept {
-		const auto level = getLevel(var);
-		return !(level != GLOBAL_LEVEL && level != call_number);
-	}
+	Profiler *profiler = nullptr; /* only for --profile */
 
-	inline EValue& value(int64_t var){
-		if(!checkLevel(var) || getType(var) == Primitive::INVALID){
-			throw RuntimeError("Undefined variable");
-		}
-		return var_vals[var];
-	}
-	inline EValue& value_unchecked(int64_t var) noexcept {
-		return var_vals[var];
-	}
-	inline const EValue& getValue(int64_t var) const {
-		if(!checkLevel(var) || getType(var) == Primitive::INVALID){
-			throw RuntimeError("Undefined variable");
+	// Limits {{{
+	/* The time limit starts counting from here. */
+	inline void setLimits(const Limits& limits_){
+		limits = limits_;
+		steps_done = 0;
+		if(limits.seconds != 0){
+			deadline = std::chrono::steady_clock::now()
+				+ std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(limits.seconds));
 		}
-		return var_vals[var];
+		nextBatch();
 	}
-	inline const EType& getType(int64_t var) const noexcept {
-		return var_types[var];
+	/* Called on every loop iteration and function call. */
+	inline void step(){
+		if(--countdown == 0) checkLimits();
 	}
-	inline int32_t getLevel(int64_t var) const noexcept {
-		return var_call_level[var];
+	// }}}
+
+	// Variables {{{
+	/* Sets up the globals and the top level's frame. */
+	inline void init(uint32_t global_count, uint32_t frame_size){
+		globals.assign(global_count, EValue());
+		global_types.assign(global_count, EType());
+		if(stack == nullptr) stack.reset(new EValue[STACK_SIZE]);
+		frame = { stack.get(), stack.get(), nullptr };
+		frame = allocFrame(frame_size, nullptr);
+		depth = 0;
 	}
-	inline void setLevel(int64_t var, int32_t level) noexcept {
-		var_call_level[var] = level;
+	inline EValue& value(const Slot& slot){
+		switch(slot.frame){
+			case Slot::Frame::LOCAL:
+				return frame.base[slot.index];
+			case Slot::Frame::REF:
+				return *frame.base[slot.index].ref;
+			case Slot::Frame::GLOBAL_CHECKED:
+				if(global_types[slot.index] == Primitive::INVALID){
+					throw RuntimeError("Undefined variable");
+				}
+				[[fallthrough]];
+			default:
+				return globals[slot.index];
+		}
 	}
-	inline void setType(int64_t var, EType type){
-		if(var_types[var].primtype != Primitive::INVALID){
-			throw TypeError("Variable already has type " + var_types[var].to_str()
-					+ ", but was attempted to be redeclared with " + type.to_str());
+	/* Only needed for the bounds of arrays. */
+	inline const EType& type(const Slot& slot) const noexcept {
+		if(slot.frame == Slot::Frame::LOCAL || slot.frame == Slot::Frame::REF){
+			// Only parameters can be arrays.
+			return frame.func->types[slot.index];
 		}
-		var_types[var] = type;
+		return global_types[slot.index];
 	}
-	inline void deleteVar(int64_t var) noexcept {
-		var_types[var] = Primitive::INVALID;
+	inline void declare(uint32_t slot, const EType& type, const EValue val){
+		global_types[slot] = type;
+		globals[slot] = val;
+		allocVar(&globals[slot], type);
 	}
-	inline void expectType(int64_t var, const EType& type) const {
-		if(var_types[var] != type){
-			throw TypeError("Expected type " + type.to_str()
-					+ ", but got type " + var_types[var].to_str());
+	/* Makes room for a call frame of `size` values after the current one,
+	 * so the arguments can be put in before it's entered.
+	 * Frames are entered and left by just setting `frame`. */
+	inline Frame allocFrame(uint32_t size, const EFunc *func){
+		if(size > static_cast<size_t>(stack.get() + STACK_SIZE - frame.end)){
+			throw RuntimeError("Stack overflow");
 		}
+		const Frame res = { frame.end, frame.end + size, func };
+		frame.end += size;
+		return res;
 	}
+	// }}}
 private:
-	void allocArr(EValue *val, const Primitive primtype, const std::vector<std::pair<int64_t,int64_t>> bounds, size_t currpos){
-		if(currpos >= bounds.size()){
-			allocVar(val, primtype);
-			return;
-		}
-		// e.g. ARRAY[10:0]
-		if(bounds[currpos].first > bounds[currpos].second){
-			throw TypeError("Cannot have array with larger start index than end");
-		}
-		val->vals = new std::vector<EValue>(bounds[currpos].second - bounds[currpos].first + 1);
-		for(EValue& v : *val->vals){
-			allocArr(&v, primtype, bounds, currpos+1);
+	/* Arrays are one flat buffer, however many dimensions they have. */
+	inline void allocArr(EValue *val, const EType& type){
+		for(const auto& b : type.bounds){
+			// e.g. ARRAY[10:0]
+			if(b.first > b.second){
+				throw TypeError("Cannot have array with larger start index than end");
+			}
 		}
+		size_t size;
+		if(!type.size(size) || size > EArray::MAX_LENGTH) throw RuntimeError("Array is too big");
+		charge(EArray::bytes(type.primtype, size));
+		val->arr = track(new EArray(size, type.primtype));
 	}
-
+	inline EArray *track(EArray *arr) noexcept {
+		arr->next = arrays;
+		if(arrays != nullptr) arrays->prev = arr;
+		arrays = arr;
+		array_count++;
+		return arr;
+	}
+	/* Deletes an array nothing refers to anymore. */
+	inline void drop(EArray *arr) noexcept {
+		if(arr->prev != nullptr) arr->prev->next = arr->next;
+		else arrays = arr->next;
+		if(arr->next != nullptr) arr->next->prev = arr->prev;
+		array_count--;
+		uncharge(arr->bytes());
+		delete arr;
+	}
+public:
 	inline void allocVar(EValue *val, const EType& etype){
 		// Only arrays need allocation (for now).
 		if(etype.is_array){
-			allocArr(val, etype.primtype, etype.bounds, 0);
+			allocArr(val, etype);
 		}
 	}
-	inline void copyArr(EValue *og, EValue *val, size_t dim){
-		if(dim == 0){
-			*val = *og;
-		} else {
-			val->vals = new std::vector<EValue>(og->vals->size());
-			for(size_t i = 0; i < og->vals->size(); i++){
-				copyArr(&(*og->vals)[i], &(*val->vals)[i], dim-1);
+	/* Arrays are shared until one side writes to them (unless they're pinned). */
+	inline void copyValue(EValue val, const EType& type, EValue *target) {
+		if(type.is_array){
+			if(val.arr->pins != 0){
+				charge(val.arr->bytes());
+				val.arr = track(new EArray(*val.arr));
+			} else {
+				val.arr->refs++;
 			}
 		}
+		*target = val;
 	}
-public:
-	inline void allocVar(int64_t id, const EType& type){
-		allocVar(&value_unchecked(id), type);
+	/* For when a variable holding an array goes away, or gets a different one.
+	 * The array is deleted if that was the last thing referring to it. */
+	inline void release(const EValue val) noexcept {
+		if(val.arr == nullptr) return; // never DECLAREd
+		if(--val.arr->refs == 0 && val.arr->pins == 0) drop(val.arr);
 	}
-	inline void copyValue(EValue val, const EType& type, EValue *target) {
-		if(type.is_array){
-			copyArr(&val, target, type.bounds.size());
-		} else {
-			*target = val;
+	/* Puts the array `val`, which already has its own reference, into the variable `target`,
+	 * and releases what was there.
+	 * If that's pinned, a BYREF parameter still points into it,
+	 * so it stays where it is and gets `val`'s elements instead. */
+	inline void replace(EValue& target, const EValue val){
+		const EValue old = target;
+		if(old.arr != nullptr && old.arr->pins != 0 && old.arr != val.arr){
+			overwrite(old.arr, *val.arr);
+			release(val);
+			return;
 		}
+		target = val;
+		release(old);
+	}
+	/* For when a BYREF parameter that points into an array goes away. */
+	inline void unpin(EArray *arr) noexcept {
+		if(--arr->pins == 0 && arr->refs == 0) drop(arr);
 	}
-	inline void copyVar(EValue val, const EType& type, int32_t level, int64_t target_id) {
-		if(type == Primitive::INVALID) {
-			throw RuntimeError("Attempt to copy variable which doesn't exist");
+	/* Where the element at `idx` (one index per dimension) is in an array of `type`.
+	 * `index(i)` gives the i'th index. */
+	template<typename F>
+	static inline size_t offset(const EType& type, const F& index){
+		size_t res = 0;
+		for(size_t i = 0; i < type.bounds.size(); i++){
+			const int64_t idx = index(i);
+			const auto [start, end] = type.bounds[i];
+			if(idx < start || idx > end){
+				throw RuntimeError("Out-of-bounds index " + std::to_string(idx));
+			}
+			res = res * (end - start + 1) + (idx - start);
 		}
-		setType(target_id, type);
-		setLevel(target_id, level);
-		copyValue(val, type, &value(target_id));
+		return res;
+	}
+	/* `arr` gets its own copy first if it's shared with anything. */
+	inline void setElement(EValue& arr, const size_t i, const EValue val){
+		own(arr);
+		if(arr.arr->needsPage(i)) charge(EArray::PAGE_BYTES);
+		arr.arr->set(i, val);
 	}
-	inline void initVar(int64_t id, int32_t call_level, const EType& type, const EValue val){
-		if(getType(id) != Primitive::INVALID){
-			throw RuntimeError("Cannot initialize already-initialized variable");
+	/* For a BYREF parameter, which has to point to the element. */
+	inline EValue& refElement(EValue& arr, const size_t i){
+		own(arr);
+		if(arr.arr->packing != EArray::Packing::NONE){
+			const size_t before = arr.arr->bytes();
+			arr.arr->unpack();
+			if(arr.arr->bytes() >= before) charge(arr.arr->bytes() - before);
+			else uncharge(before - arr.arr->bytes());
 		}
-		setType(id, type);
-		var_vals[id] = val;
-		var_call_level[id] = call_level;
-		allocVar(id, type);
+		if(arr.arr->needsPage(i)) charge(EArray::PAGE_BYTES);
+		return arr.arr->at(i);
 	}
-
-	Env(int64_t identifier_count, std::map<std::string_view, int64_t>& id_map) : var_types(identifier_count+1, Primitive::INVALID), var_vals(identifier_count+1),
-	var_call_level(identifier_count+1, 0) {
-		// check for inbuilt functions
-		for(const auto& func : builtin::global_funcs){
-			auto it = id_map.find(func.first);
-			if(it != id_map.end()){
-				functable.insert(std::make_pair(it->second, func.second));
+private:
+	/* Copies the elements of `from` (the same size) into `to`. */
+	inline void overwrite(EArray *to, const EArray& from){
+		for(size_t i = 0; i < to->length; i++){
+			const EValue val = from.get(i);
+			if(to->needsPage(i)){
+				// it already reads as `fill`
+				if(std::memcmp(&val, &to->fill, sizeof(EValue)) == 0) continue;
+				charge(EArray::PAGE_BYTES);
 			}
+			to->set(i, val);
 		}
 	}
+	inline void own(EValue& arr){
+		if(arr.arr->refs == 1) return;
+		charge(arr.arr->bytes());
+		arr.arr->refs--;
+		arr.arr = track(new EArray(*arr.arr));
+	}
+public:
+	inline MemoryStats memoryStats() const noexcept {
+		return { bytes, peak, array_count };
+	}
 
+	OutBuffer out;
 #ifdef TESTS
-public:
-	std::ostringstream out;
 	std::istringstream in;
+	Env() : reader(in) {}
 #else 
-	std::ostream& out = std::cout;
-	std::istream& in = std::cin;
+	std::istream& in;
+	/* The output goes to `out_` whenever it's flushed, and at the latest when the Env goes away. */
+	Env(std::istream& in_ = std::cin, std::ostream& out_ = std::cout):
+		out(&out_), in(in_), reader(in) {}
 #endif
+	Env(const Env&) = delete;
+	Env& operator=(const Env&) = delete;
+	/* Whatever arrays are left go with it. */
+	~Env(){
+		while(arrays != nullptr){
+			EArray *next = arrays->next;
+			delete arrays;
+			arrays = next;
+		}
+	}
+private:
+	InBuffer reader; /* reads from `in` */
+	StringStore strings; /* the STRINGs that were INPUT, copied out of the InBuffer */
+public:
+	/* Called when a run starts, with the store its literals were interned in. */
+	inline void useLiterals(const StringStore& literals) noexcept {
+		strings.extend(&literals);
+	}
 	void input(EValue &val, const EType type){
 		if(type.is_array) throw TypeError("Cannot input array");
+		out.flush();
+		// Every type takes up one line.
+		// It's only a view into the InBuffer, so it has to be copied if it's used as a STRING.
+		std::string_view str;
+		const bool got = reader.line(str);
 		switch(type.primtype){
 #define CASE(x) case Primitive:: x
 			CASE(INTEGER):
 				{
-					std::string str;
-					std::getline(in, str);
-					if(!in) goto fail_i;
+					if(!got) goto fail_i;
 					{
 						auto res = std::from_chars(str.data(), str.data() + str.size(), val.i64);
 						if(res.ptr != str.data() + str.size()) goto fail_i;
@@ -196,8 +372,6 @@ pass_i:
 				break;
 			CASE(REAL):
 				{
-					std::string str;
-					std::getline(in, str);
 					bool dot = true;
 					for(size_t i = 0; i < str.size(); i++){
 						if(isDigit(str[i]) || (dot && str[i] == '.')){
@@ -211,8 +385,6 @@ pass_i:
 				break;
 			CASE(BOOLEAN):
 				{
-					std::string str;
-					std::getline(in, str);
 					if(str == "TRUE") val.b = true;
 					else if(str == "FALSE") val.b = false;
 					else throw RuntimeError("User did not input BOOLEAN correctly");
@@ -220,19 +392,15 @@ pass_i:
 				break;	
 			CASE(CHAR):
 				{
-					std::string str;
-					std::getline(in, str);
-					val.c = str[0];
-					if(!in) throw RuntimeError("End of input reached");
+					if(!got) throw RuntimeError("End of input reached");
+					val.c = str.empty() ? '\0' : str[0];
 				}
 				break;
 			CASE(DATE):
 				{
 					uint16_t day, month;
 					uint16_t year;
-					std::string str;
-					std::getline(in, str);
-					if(!in) goto fail;
+					if(!got) goto fail;
 					{
 						const char *curr = str.data(), *end = str.data() + str.size();
 						auto res = std::from_chars(curr, end, day);
@@ -253,10 +421,14 @@ pass:
 				break;
 			CASE(STRING):
 				{
-					std::string str;
-					std::getline(in, str);
-					if(!in) throw RuntimeError("End of input reached");
-					val.str = global::toStrView(str);
+					if(!got) throw RuntimeError("End of input reached");
+					// Only a new string has to be copied.
+					if(const std::string_view *same = strings.find(str)){
+						val.str = EString{ same };
+						break;
+					}
+					charge(str.size() + sizeof(std::string_view));
+					val.str = strings.internCopy(str);
 				}
 				break;
 			default:
@@ -265,17 +437,23 @@ pass:
 		}
 	}
 	void output(const EValue val, const EType& type){
-#define IFTYPE(x) if(type == Primitive:: x)
-		IFTYPE(INTEGER) out << val.i64;
-		else IFTYPE(REAL) out << val.frac.to_double();
-		else IFTYPE(BOOLEAN) out << (val.b ? "TRUE" : "FALSE");
-		else IFTYPE(CHAR) out << val.c;
-		else IFTYPE(DATE) out << val.date;
-		else IFTYPE(STRING) out << val.str;
-		else {
+		if(type.is_array){
 			throw TypeError("Cannot output array");
 		}
-#undef IFTYPE
+		output(val, type.primtype);
+	}
+	void output(const EValue val, const Primitive primtype){
+		switch(primtype){
+#define CASE(x) case Primitive:: x
+			CASE(INTEGER): out << val.i64; break;
+			CASE(REAL): out << val.frac.to_double(); break;
+			CASE(BOOLEAN): out << (val.b ? "TRUE" : "FALSE"); break;
+			CASE(CHAR): out << val.c; break;
+			CASE(DATE): out << val.date; break;
+			CASE(STRING): out << val.str; break;
+			default: throw TypeError("Cannot output array");
+#undef CASE
+		}
 	}
 };
 
@@ -6,4 +6,25 @@ class RuntimeError : public std::runtime_error {
 	using std::runtime_error::runtime_error;
 };
 
+/* Going over one of the Env::Limits.
+ * They're still RuntimeErrors, but each gets its own exit code,
+ * so whoever's running the program can tell what happened. */
+class StepLimitError : public RuntimeError {
+public:
+	using RuntimeError::RuntimeError;
+	static constexpr int exit_code = 3;
+};
+
+class MemoryLimitError : public RuntimeError {
+public:
+	using RuntimeError::RuntimeError;
+	static constexpr int exit_code = 4;
+};
+
+class TimeLimitError : public RuntimeError {
+public:
+	using RuntimeError::RuntimeError;
+	static constexpr int exit_code = 5;
+};
+
 #endif /* ERROR_HPP */
@@ -93,6 +93,8 @@ public:
 
 	// Constructors and operator= {{{
 
+	/* Left uninitialized, like an int (so an EValue can be too). */
+	Fraction() = default;
 	explicit inline Fraction(num_t x) : top(x), bot(1) {}
 
 	inline Fraction(num_t top_, num_t bottom_): top(top_), bot(bottom_) {
@@ -5,11 +5,13 @@
 #include <map>
 #include <sstream>
 #include <list>
+#include <deque>
+#include <unordered_map>
 #include "value.hpp"
 
 namespace builtin {
-	static std::random_device rd;
-	static std::mt19937_64 gen(rd());
+	/* One per thread, so programs running side by side in --batch don't race on it. */
+	inline thread_local std::mt19937_64 gen(std::random_device{}());
 	namespace rnd {
 		inline Fraction<> rnd(){
 			std::uniform_int_distribution<uint16_t> d;
@@ -51,13 +53,48 @@ namespace builtin {
 	};
 }
 
-namespace global {
-	static std::list<std::string> strings; // so string_view doesn't leak
-	inline std::string_view toStrView(const std::string& str){
-		strings.push_back(str);
+/* Owns strings that are only handed out as string_views
+ * (string literals, identifiers, STRING input), so they don't dangle.
+ * Each Lexer, Parser, Chunk and Env has its own, so nothing here is shared between runs.
+ *
+ * It also interns STRING values: equal strings get the same view,
+ * so they're equal exactly when they point to the same one (see EString).
+ * An Env's store extends the running program's, so INPUT that's equal to a literal gets the literal's view. */
+class StringStore {
+	std::list<std::string> strings;
+	std::deque<std::string_view> views; /* what the EStrings point to */
+	std::unordered_map<std::string_view, const std::string_view *> interned;
+	const StringStore *base = nullptr; /* looked in first */
+public:
+	inline std::string_view add(std::string str){
+		strings.push_back(std::move(str));
 		return strings.back();
 	}
-	static std::istringstream dummy_stream;
-}
+	/* The STRING equal to `str` that was already interned, if there is one. */
+	inline const std::string_view *find(const std::string_view str) const {
+		if(str.empty()) return &empty_string;
+		if(base != nullptr){
+			if(const std::string_view *res = base->find(str)) return res;
+		}
+		const auto it = interned.find(str);
+		return it == interned.end() ? nullptr : it->second;
+	}
+	/* The STRING value for `str`, whose characters have to outlive it if it's new. */
+	inline EString intern(const std::string_view str){
+		if(const std::string_view *res = find(str)) return EString{ res };
+		views.push_back(str);
+		interned.emplace(str, &views.back());
+		return EString{ &views.back() };
+	}
+	/* Same, but it keeps its own copy of the characters if it's new. */
+	inline EString internCopy(const std::string_view str){
+		if(const std::string_view *res = find(str)) return EString{ res };
+		return intern(add(std::string(str)));
+	}
+	/* Strings that are already in `base_` (which has to outlive this) aren't interned again. */
+	inline void extend(const StringStore *base_) noexcept {
+		base = base_;
+	}
+};
 
 #endif /* GLOBALS_HPP */
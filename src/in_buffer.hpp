@@ -0,0 +1,100 @@
+#ifndef IN_BUFFER_HPP
+#define IN_BUFFER_HPP
+
+#include <cstring>
+#include <istream>
+#include <iostream>
+#include <memory>
+#include <string_view>
+
+#if defined(__unix__) || defined(__APPLE__)
+#define PCSE_HAVE_READ
+#include <cerrno>
+#include <unistd.h>
+#endif
+
+/* Where INPUT comes from.
+ * The input is read a big chunk at a time, and line() hands out each line
+ * as a view into the chunk, so nothing gets copied to parse it.
+ *
+ * The chunk is reused as soon as its lines have been read, so a line has to be copied
+ * if it's needed for longer (the Env interns a STRING's own copy).
+ * So the buffer stays one chunk, however much is read and whatever is kept of it. */
+class InBuffer {
+	static constexpr size_t CHUNK_SIZE = 1 << 16;
+	std::istream& stream;
+	int fd = -1; /* read() from this directly instead, if it's a terminal or pipe behind std::cin */
+	std::unique_ptr<char[]> buf;
+	size_t cap;
+	size_t begin = 0, end = 0; /* the part of buf that hasn't been read yet */
+	bool eof = false;
+
+	/* Reads whatever's available (at least 1 byte unless it's the end), without waiting for more. */
+	inline size_t read(char *dst, size_t n){
+#ifdef PCSE_HAVE_READ
+		if(fd >= 0){
+			ssize_t res;
+			do {
+				res = ::read(fd, dst, n);
+			} while(res < 0 && errno == EINTR);
+			return res > 0 ? res : 0;
+		}
+#endif
+		if(!stream.read(dst, 1)) return 0;
+		return 1 + std::max<std::streamsize>(stream.readsome(dst + 1, n - 1), 0);
+	}
+	/* Gets more input after what's unread, moving the unread part to the start of a chunk first. */
+	inline void refill(){
+		const size_t unread = end - begin;
+		if(unread == cap){
+			// a line longer than the chunk
+			std::unique_ptr<char[]> next(new char[cap * 2]);
+			std::memcpy(next.get(), buf.get() + begin, unread);
+			buf = std::move(next);
+			cap *= 2;
+		} else if(begin != 0){
+			std::memmove(buf.get(), buf.get() + begin, unread);
+		}
+		begin = 0;
+		end = unread;
+		const size_t got = read(buf.get() + end, cap - end);
+		if(got == 0) eof = true;
+		end += got;
+	}
+public:
+	explicit InBuffer(std::istream& stream_, size_t chunk_size = CHUNK_SIZE):
+		stream(stream_), buf(new char[chunk_size]), cap(chunk_size)
+	{
+#ifdef PCSE_HAVE_READ
+		if(&stream == &std::cin) fd = STDIN_FILENO;
+#endif
+	}
+	InBuffer(const InBuffer&) = delete;
+	InBuffer& operator=(const InBuffer&) = delete;
+
+	/* The next line, without its '\n'. It's only valid until the next call.
+	 * Returns false if there's nothing left (like std::getline). */
+	inline bool line(std::string_view& res){
+		size_t scanned = begin;
+		for(;;){
+			const char *start = buf.get() + begin;
+			const void *nl = std::memchr(buf.get() + scanned, '\n', end - scanned);
+			if(nl != nullptr){
+				res = std::string_view(start, static_cast<const char *>(nl) - start);
+				begin += res.size() + 1;
+				return true;
+			}
+			if(eof){
+				if(begin == end) return false;
+				res = std::string_view(start, end - begin);
+				begin = end;
+				return true;
+			}
+			scanned = end - begin;
+			refill();
+			scanned += begin;
+		}
+	}
+};
+
+#endif /* IN_BUFFER_HPP */
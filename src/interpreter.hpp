@@ -1,111 +1,130 @@
 #ifndef INTERPRETER_HPP
 #define INTERPRETER_HPP
 
+#include <optional>
 #include "parser.hpp"
 
 
-template<typename... Args>
-void expectTypeEqual(const EType& t1, const EType& t, const Args&... args){
-	if(!isAnyOf(t1, t, args...)){
-		throw TypeError("Bad type " + t1.to_str() + ", expected any of: " + EType(t).to_str() + (", " + EType(args).to_str() + ...));
-	}
-}
-
-/* More understandable error messages when we only expect one type */
+/* Everything but the array bounds has been checked by the TypeChecker. */
 void expectTypeEqual(const EType& t1, const EType& t2){
 	if(t1 != t2){
 		throw TypeError("Bad type " + t1.to_str() + ", expected " + t2.to_str());
 	}
 }
 
+// arrayType {{{
+
+/* The bounds of an array are only known at runtime,
+ * so the full type of an array expression has to be looked up when it's needed.
+ * (Arrays can only come from a variable or a function call.) */
+const EType& arrayType(const Expr& e, Env& env){
+	const Primary& p = *e.primary;
+	if(p.primtype() == TokenType::IDENTIFIER) return env.type(p.main().lvalue.slot);
+	/* if(p.primtype() == TokenType::CALL) */
+	const EFunc *func = env.functable[p.all.func];
+	if(func == nullptr) throw RuntimeError("Cannot call non-function");
+	return func->ret_type;
+}
+
+// }}}
+
 // defFunc, callFunc {{{
 
 void defFunc(Env& env, const Stmt<true> &stmt){
 	uint_least8_t arity = stmt.params.size();
-	env.functable.try_emplace(stmt.ids[0], arity, EFunc::What::RUNTIME);
-	EFunc& func = env.functable[stmt.ids[0]];
-	func.func_loc = (void *)&stmt.blocks[0];
+	EFunc& func = env.defs.emplace_back(arity, EFunc::What::RUNTIME);
+	func.func_loc = &stmt;
 	for(size_t i = 0; i < stmt.params.size(); i++){
-		const Param &param = stmt.params[i];
-		if(param.byref) throw RuntimeError("BYREF is not supported");
-		func.ids[i] = param.ident;
-		func.types[i] = param.type.to_etype(env);
+		func.types[i] = stmt.params[i].type.to_etype(env);
 	}
 	if(stmt.types.size()) {
 		func.ret_type = stmt.types[0].to_etype(env);
 	}
+	env.functable[stmt.func] = &func;
 }
 
-// Calls a function.
-const std::optional<EValue> callFunc(Env& env, int64_t id, const std::vector<Expr>& args) {
-	auto func_it = env.functable.find(id);
-	if(func_it == env.functable.end()){
+// Calls function number `index`.
+const std::optional<EValue> callFunc(Env& env, uint32_t index, const ArenaVec<Expr>& args) {
+	const EFunc *func_ptr = env.functable[index];
+	if(func_ptr == nullptr){
 		throw RuntimeError("Cannot call non-function");
 	}
-	const EFunc &func = env.functable[id];
-	if(args.size() != func.arity){
-		throw RuntimeError("Invalid number of parameters for function");
-	}
-	const std::unique_ptr<EValue[]> argvals(new EValue[func.arity]);
+	const EFunc &func = *func_ptr;
+	const Stmt<true> *def = (const Stmt<true> *)func.func_loc;
+	env.step();
+	// The arguments go straight into the new frame.
+	// It's only entered once they've all been evaluated,
+	// since evaluating them happens in the caller's frame.
+	const Env::Frame caller = env.frame;
+	const Env::Frame callee = env.allocFrame(func.what == EFunc::What::BUILTIN ? func.arity : def->frame_size, &func);
+	// The arrays with an element passed BYREF, to unpin afterwards.
+	EArray *pinned[64];
+	size_t pins = 0;
 	for(size_t i = 0; i < args.size(); i++){
-		expectTypeEqual(args[i].type(env), func.types[i]);
-		argvals[i] = args[i].eval(env);
+		if(func.types[i].is_array){
+			expectTypeEqual(arrayType(args[i], env), func.types[i]);
+		}
+		if(func.what == EFunc::What::RUNTIME && def->params[i].byref){
+			// The TypeChecker made sure it's a variable.
+			const LValue& lv = args[i].primary->main().lvalue;
+			EValue& target = lv.ref(env);
+			if(lv.indexes != nullptr){
+				// ref() already gave it its own copy, so it isn't shared.
+				EArray *arr = env.value(lv.slot).arr;
+				arr->pins++;
+				pinned[pins++] = arr;
+			}
+			callee.base[i].ref = &target;
+			continue;
+		}
+		if(args[i].isCall()) callee.base[i] = args[i].eval(env);
+		else env.copyValue(args[i].eval(env), func.types[i], &callee.base[i]);
 	}
 	std::optional<EValue> retval = std::nullopt;
 	if(func.what == EFunc::What::BUILTIN){ // builtin function
 		// Builtin functions take an array of `EValue`s and return an EValue
 		auto func_ptr = (EValue (*)(EValue *))func.func_loc;
-		EValue ret = func_ptr(argvals.get());
+		EValue ret = func_ptr(callee.base);
 		if(func.ret_type != Primitive::INVALID){
 			retval = ret;
 		}
 	} else { // runtime function
-		std::vector<EType> old_types(func.arity);
-		std::vector<EValue> old_vals(func.arity);
-		std::vector<int32_t> old_levels(func.arity);
-		{
-			// Keep track of the old variables.
-			for(size_t i = 0; i < args.size(); i++){
-				int64_t ident = func.ids[i];
-				old_types[i] = env.getType(ident);
-				if(old_types[i] != Primitive::INVALID){
-					old_vals[i] = env.getValue(ident);
-					old_levels[i] = env.getLevel(ident);
-				}
-			}
-			// Put in the new ones.
-			env.call_number++;
-			for(size_t i = 0; i < args.size(); i++){
-				int64_t ident = func.ids[i];
-				env.deleteVar(ident);
-				env.copyVar(argvals[i], func.types[i], env.call_number, ident);
-			}
-		}
-		const Expr *ret = ((Block *)func.func_loc)->eval(env);
+		const size_t caller_line = (env.profiler != nullptr) ? env.profiler->current() : 0;
+		if(++env.depth > Env::MAX_DEPTH) throw RuntimeError("Stack overflow");
+		env.frame = callee;
+		const Expr *ret = def->blocks[0].eval(env);
 		if(ret == nullptr && func.ret_type != Primitive::INVALID){ // should have returned, but didn't
 			throw TypeError("Function didn't return");
 		}
 		if(ret != nullptr){
-			// make sure the return type and the expr are equal
-			expectTypeEqual(ret->type(env), func.ret_type);
+			// make sure the returned array is the right size
+			if(func.ret_type.is_array){
+				expectTypeEqual(arrayType(*ret, env), func.ret_type);
+			}
 			retval = ret->eval(env);
+			// The caller gets its own reference, since the parameters are about to let go of theirs.
+			if(func.ret_type.is_array && !ret->isCall()){
+				env.copyValue(*retval, func.ret_type, &*retval);
+			}
 		}
-		env.call_number--;
-		// Restore the old variables.
-		for(size_t i = 0; i < func.arity; i++){
-			int64_t varid = func.ids[i];
-			env.deleteVar(varid);
-			if(old_types[i] != Primitive::INVALID){
-				env.initVar(varid, old_levels[i], old_types[i], old_vals[i]);
+		for(size_t i = 0; i < args.size(); i++){
+			if(func.types[i].is_array && !def->params[i].byref){
+				env.release(callee.base[i]);
 			}
 		}
+		while(pins > 0){
+			env.unpin(pinned[--pins]);
+		}
+		if(env.profiler != nullptr) env.profiler->line(caller_line, false);
+		env.depth--;
 	}
+	env.frame = caller;
 	return retval;
 }
 
 // }}}
 
-// Primary, (Unary|Bin)Expr (all the eval() functions which return `EValue`s) {{{
+// Primary, LValue, Expr (all the eval() functions which return `EValue`s) {{{
 
 EValue Primary::eval(Env& env) const {
 #define IF(x) if(all.primtype == TokenType:: x) 
@@ -115,262 +134,97 @@ EValue Primary::eval(Env& env) const {
 	IF(TRUE) return true;
 	IF(FALSE) return false;
 	IF(DATE_C) return main().lt.date;
-	IF(STR_C) return main().lt.str;
+	IF(STR_C) return all.str;
 	IF(IDENTIFIER) return all.main.lvalue.eval(env);
 	IF(CALL) {
 		// Typechecking should be done for us. :P
-		const std::optional<EValue> retval = callFunc(env, all.func_id, *all.main.args);
+		const std::optional<EValue> retval = callFunc(env, all.func, *all.main.args);
 		if(!retval) {
 			throw TypeError("Cannot call procedure without using CALL");
 		}
 		return retval.value();
 	}
-	IF(INVALID) return all.main.expr->eval(env);
 	throw RuntimeError("Invalid primary type. (INTERNAL ERROR)");
 }
 
-EType Primary::type(Env& env) const {
-#define RET(x) return Primitive:: x
-	IF(REAL_C) RET(REAL);
-	IF(INT_C) RET(INTEGER);
-	IF(CHAR_C) RET(CHAR);
-	IF(TRUE) RET(BOOLEAN);
-	IF(FALSE) RET(BOOLEAN);
-	IF(DATE_C) RET(DATE);
-	IF(STR_C) RET(STRING);
-	IF(IDENTIFIER) return all.main.lvalue.type(env);
-	IF(CALL){
-		auto func_it = env.functable.find(all.func_id);
-		if(func_it == env.functable.end()){
-			throw RuntimeError("Cannot call non-function");
-		}
-		const auto type = func_it->second.ret_type;
-		if(type == Primitive::INVALID){
-			throw RuntimeError("Cannot call procedure and use it as a value");
-		}
-		return type;
-	}
-	IF(INVALID) return all.main.expr->type(env);
 #undef IF
-#undef RET
-	throw RuntimeError("Invalid primary type. (INTERNAL ERROR)");
+
+/* Where this element is in its array.
+ * An index could call a function that replaces the array,
+ * so the array must only be read from the variable after this. */
+static inline size_t offset(const LValue& lv, Env& env){
+	return Env::offset(env.type(lv.slot), [&](size_t i){
+		return (*lv.indexes)[i].eval(env).i64;
+	});
 }
 
 EValue LValue::eval(Env& env) const {
-	const EType& type = env.getType(id);
-	if(indexes != nullptr){
-		const EValue *val = &env.getValue(id);
-		if(indexes->size() != type.bounds.size()){
-			throw TypeError("Cannot index a non-array");
-		}
-		for(size_t i = 0; i < type.bounds.size(); i++){
-			expectTypeEqual((*indexes)[i].type(env), Primitive::INTEGER);
-			const int64_t index = (*indexes)[i].eval(env).i64;
-			if(index < type.bounds[i].first || index > type.bounds[i].second){
-				throw RuntimeError("Out-of-bounds index " + std::to_string(index));
-			}
-			val = &(*val->vals)[index - type.bounds[i].first];
-		}
-		return *val;
-	} else {
-		return env.getValue(id);
-	}
+	if(indexes == nullptr) return env.value(slot);
+	const size_t i = offset(*this, env);
+	return env.value(slot).arr->get(i);
 }
 
 EValue& LValue::ref(Env& env) const {
-	const EType& type = env.getType(id);
-	if(indexes != nullptr){
-		EValue *val = &env.value(id);
-		if(indexes->size() != type.bounds.size()){
-			throw TypeError("Cannot index a non-array");
-		}
-		for(size_t i = 0; i < type.bounds.size(); i++){
-			expectTypeEqual((*indexes)[i].type(env), Primitive::INTEGER);
-			const int64_t index = (*indexes)[i].eval(env).i64;
-			if(index < type.bounds[i].first || index > type.bounds[i].second){
-				throw RuntimeError("Out-of-bounds index " + std::to_string(index));
-			}
-			val = &(*val->vals)[index - type.bounds[i].first];
-		}
-		return *val;
-	} else {
-		return env.value(id);
-	}
+	if(indexes == nullptr) return env.value(slot);
+	const size_t i = offset(*this, env);
+	return env.refElement(env.value(slot), i);
 }
 
-EValue UnaryExpr::eval(Env& env) const {
-	if(op == TokenType::INVALID){
-		return main.primary->eval(env);
-	} else if(op == TokenType::NOT){
-		expectTypeEqual(main.unexpr->type(env), Primitive::INTEGER);
-		/* Did you know C++ has a `not` keyword? :) */
-		return not (main.primary->eval(env).b);
-	} else if(op == TokenType::MINUS){
-		const auto& type = main.unexpr->type(env);
-		expectTypeEqual(type, Primitive::INTEGER, Primitive::REAL);
-		if(type == Primitive::INTEGER) return -main.unexpr->eval(env).i64;
-		else /* if(type == Primitive::REAL) */ return -main.unexpr->eval(env).frac;
-	} else {
-		throw RuntimeError("Invalid unary expr operator. This should not have happened!");
+void LValue::assign(Env& env, const EValue val) const {
+	if(indexes == nullptr){
+		env.value(slot) = val;
+		return;
 	}
+	const size_t i = offset(*this, env);
+	env.setElement(env.value(slot), i, val);
 }
 
-template<uint16_t Level>
-EType BinExpr<Level>::type(Env& env) const {
-	const EType ltype = left.type(env);
-	if(opt.op == TokenType::INVALID) return ltype; /* no operators */
-	if constexpr (Level <= 2) {
-		return Primitive::BOOLEAN;	
-	} else { 
-		const EType rtype = opt.right->type(env);
-		if constexpr (Level == 3){
-			// Plus, Minus
-			// Choose which one is a REAL
-			if(rtype == Primitive::REAL) return rtype;
-			else if(ltype == Primitive::REAL) return ltype;
-			/* Check if they're both ints */
-			if(ltype == Primitive::INTEGER && rtype == Primitive::INTEGER) return Primitive::INTEGER;
-			// Any other case is mathematically invalid			
-			throw TypeError("Invalid type applied to math expression");
-		} else {
-			// First enforce that they're either INTEGERs or REALs
-			if(!(isAnyOf(ltype, Primitive::REAL, Primitive::INTEGER) &&
-				 isAnyOf(rtype, Primitive::REAL, Primitive::INTEGER))){
-				throw TypeError("Invalid type applied to math expression");
-			}
-			// We have to account for the slash
-			if(opt.op == TokenType::SLASH) return Primitive::REAL;
-			else if(opt.op == TokenType::STAR) {
-				// REAL op INTEGER => REAL
-				if(rtype == Primitive::REAL) return rtype;
-				else return ltype;
-			}
-			// MOD, DIV both only take integers
-			else {
-				expectTypeEqual(ltype, Primitive::INTEGER);
-				expectTypeEqual(rtype, Primitive::INTEGER);
-				return Primitive::INTEGER;
-			}
-		}
-	}
+void LValue::input(Env& env) const {
+	if(indexes == nullptr) return env.input(env.value(slot), type.primtype);
+	const size_t i = offset(*this, env);
+	EValue val;
+	env.input(val, type.primtype);
+	env.setElement(env.value(slot), i, val);
 }
 
-template<uint16_t Level>
-EValue BinExpr<Level>::eval(Env& env) const {
-	EValue leftval = left.eval(env);
-	if(opt.op == TokenType::INVALID) return leftval;
-	const EType ltype = left.type(env);
-	EValue rightval = opt.right->eval(env);
-	if constexpr (Level == 0) {
-		// OR
-		leftval.b |= rightval.b;
-		return leftval;
-	} else if constexpr (Level == 1) {
-		// AND
-		leftval.b &= rightval.b;
-		return leftval;
-	} else if constexpr (Level == 2){
-		// all the comparison operators
-		const EType rtype = opt.right->type(env);
-#define OPCASE(l, r, x, op) \
-		case TokenType:: x: \
-			return l op r; \
-			break; 
-#define OPAPPLY(l, r, optok) \
-	switch(optok){ \
-		OPCASE(l, r, EQ, ==) \
-		OPCASE(l, r, GT, >) \
-		OPCASE(l, r, LT, <) \
-		OPCASE(l, r, GT_EQ, >=) \
-		OPCASE(l, r, LT_EQ, <=) \
-		OPCASE(l, r, LT_GT, !=) \
-		default: throw RuntimeError("Invalid operator for comparison expr. (INTERNAL ERROR)");\
+EValue Expr::eval(Env& env) const {
+	switch(kind){
+		case Kind::PRIMARY:
+			return primary->eval(env);
+		case Kind::UNARY:
+			if(op == TokenType::NOT){
+				/* Did you know C++ has a `not` keyword? :) */
+				return not (right->eval(env).b);
+			} else if(op == TokenType::MINUS){
+				if(type == Primitive::INTEGER) return -right->eval(env).i64;
+				else /* if(type == Primitive::REAL) */ return -right->eval(env).frac;
+			} else {
+				throw RuntimeError("Invalid unary expr operator. This should not have happened!");
+			}
+		case Kind::BINARY:
+			break;
 	}
-		if(ltype == Primitive::REAL && rtype == Primitive::INTEGER){
-			OPAPPLY(leftval.frac, rightval.i64, opt.op);
-		} else if(ltype == Primitive::INTEGER && rtype == Primitive::REAL){
-			OPAPPLY(rightval.frac, leftval.i64, opt.op);
-		}
-		if(ltype != rtype) throw TypeError("Cannot compare two different types");
-		if(ltype.is_array) throw TypeError("Cannot compare arrays");
-#define IFTYPE(x, l, r) if(ltype == Primitive:: x){ OPAPPLY(l, r, opt.op); }
-		IFTYPE(INTEGER, leftval.i64, rightval.i64);
-		IFTYPE(REAL, leftval.frac, rightval.frac);
-		IFTYPE(CHAR, leftval.c, rightval.c);
-		IFTYPE(BOOLEAN, leftval.b, rightval.b);
-		IFTYPE(STRING, leftval.str, rightval.str);
-		throw RuntimeError("Invalid types! (INTERNAL ERROR)");
-#undef IFTYPE
-#undef OPAPPLY
-#undef OPCASE
-	} else if constexpr (Level == 3){
-		// PLUS, MINUS
-		const EType rtype = opt.right->type(env);
-#define OPCASE(op) \
-	if(ltype == Primitive::REAL){\
-		if(rtype == Primitive::REAL) leftval.frac op##= rightval.frac;\
-		else leftval.frac op##= rightval.i64;\
-	} else {\
-		if(rtype == Primitive::REAL){\
-			leftval.frac = Fraction<>(leftval.i64);\
-			leftval.frac op##= rightval.frac;\
-		} else {\
-			leftval.i64 op##= rightval.i64;\
-		}\
-	}\
-	return leftval;
-		if(opt.op == TokenType::PLUS){
-			OPCASE(+);
-		} else if(opt.op == TokenType::MINUS){
-			OPCASE(-);
-		} else {
-			throw RuntimeError("Invalid operator for +- expr. (INTERNAL ERROR)");
-		}
-#undef OPCASE
-	} else /* if constexpr (Level == 4) */ {
-		const EType rtype = opt.right->type(env);
-#define OPCASE(op) \
-	if(ltype == Primitive::REAL){ \
-		if(rtype == Primitive::REAL) leftval.frac op##= rightval.frac;\
-		else leftval.frac op##= rightval.i64; \
-	} else { \
-		if(rtype == Primitive::REAL){ \
-			leftval.frac = Fraction<>(leftval.i64);\
-			leftval.frac -= rightval.frac;\
-		}\
-		else leftval.i64 op##= rightval.i64; \
-	}\
-	return leftval;
-	// All of these operators only work on INTEGERs or REALs,
-	// so validate ahead-of-time.
-	expectTypeEqual(ltype, Primitive::REAL, Primitive::INTEGER);
-	expectTypeEqual(rtype, Primitive::REAL, Primitive::INTEGER);
-		
-		switch(opt.op){
-			case TokenType::STAR:
-				OPCASE(*);
-				break;
-			case TokenType::SLASH:
-				if(ltype == Primitive::INTEGER){
-					auto tmp = leftval.i64;
-					leftval.frac = Fraction<>(tmp);
-				}
-				if(rtype == Primitive::INTEGER){
-					auto tmp = rightval.i64;
-					rightval.frac = Fraction<>(tmp);
-				}
-				return leftval.frac / rightval.frac;
-			case TokenType::MOD:
-			case TokenType::DIV:
-				expectTypeEqual(ltype, Primitive::INTEGER);
-				expectTypeEqual(rtype, Primitive::INTEGER);
-				return (opt.op == TokenType::DIV ? 
-						leftval.i64 / rightval.i64 :
-						leftval.i64 % rightval.i64);
-			default:
-				throw RuntimeError("Invalid operator for *,/,MOD,DIV expr. (INTERNAL ERROR)");
+	// A chain like a + b + c is a left-deep tree,
+	// so walk down the left side instead of recursing into it.
+	constexpr size_t MAX_CHAIN = 16;
+	const Expr *chain[MAX_CHAIN];
+	size_t n = 0;
+	const Expr *e = this;
+	do {
+		chain[n++] = e;
+		e = e->left;
+	} while(e->kind == Kind::BINARY && n < MAX_CHAIN);
+	EValue val = e->eval(env);
+	while(n > 0){
+		const Expr& b = *chain[--n];
+		if(b.op == TokenType::AND || b.op == TokenType::OR){
+			// The right side only gets evaluated if the left side doesn't decide it.
+			if(val.b == (b.op == TokenType::AND)) val = b.right->eval(env);
+			continue;
 		}
+		val = b.apply(val, b.right->eval(env));
 	}
+	return val;
 }
 
 // }}}
@@ -380,9 +234,6 @@ EValue BinExpr<Level>::eval(Env& env) const {
 EType Type::to_etype(Env& env, bool is_top) const {
 	if(is_array()){
 		auto nextType = all.name.rec->to_etype(env, false);
-		if(!(all.start->type(env) == Primitive::INTEGER && all.end->type(env) == Primitive::INTEGER)){
-			throw RuntimeError("The start and end types must be INTEGERs");
-		}
 		const auto startIdx = all.start->eval(env).i64;
 		const auto endIdx = all.end->eval(env).i64;
 		nextType.is_array = true;
@@ -416,11 +267,11 @@ const Expr *Stmt<TopLevel>::eval(Env& env) const {
 			CASE(DECLARE):
 				{
 					const EType type = types[0].to_etype(env);
-					env.initVar(ids[0], env.GLOBAL_LEVEL, type, (int64_t)0);
+					env.declare(slot, type, defaultValue(type.primtype));
 				}
 				break;
 			CASE(CONSTANT):
-				env.initVar(ids[0], env.GLOBAL_LEVEL, exprs[0].type(env), exprs[0].eval(env));
+				env.declare(slot, exprs[0].type.primtype, exprs[0].eval(env));
 				break;
 			CASE(PROCEDURE):
 			CASE(FUNCTION):
@@ -437,30 +288,32 @@ anylevelstmt:
 	switch(form){
 		CASE(ASSIGN):
 			{
-				const EType type = lvalues[0].type(env);
-				if(type == Primitive::INVALID){
-					throw RuntimeError("Undefined variable");
-				}
-				const EType exprtype = exprs[0].type(env);
-				if(type == Primitive::REAL && exprtype == Primitive::INTEGER){
-					lvalues[0].ref(env).frac = Fraction<>(exprs[0].eval(env).i64);
+				const SType& type = lvalues[0].type;
+				if(type == Primitive::REAL && exprs[0].type == Primitive::INTEGER){
+					lvalues[0].assign(env, Fraction<>(exprs[0].eval(env).i64));
+				} else if(type.is_array()){
+					// The sizes have to match.
+					const EType& arrtype = env.type(lvalues[0].slot);
+					expectTypeEqual(arrayType(exprs[0], env), arrtype);
+					EValue val = exprs[0].eval(env);
+					if(!exprs[0].isCall()) env.copyValue(val, arrtype, &val);
+					// The call could have changed the variable, so it's only looked at now.
+					env.replace(lvalues[0].ref(env), val);
 				} else {
-					expectTypeEqual(exprtype, type);
-					env.copyValue(exprs[0].eval(env), type, &lvalues[0].ref(env));
+					lvalues[0].assign(env, exprs[0].eval(env));
 				}
 			}
 			break;
 		CASE(INPUT):
-			env.input(lvalues[0].ref(env), lvalues[0].type(env));
+			lvalues[0].input(env);
 			break;
 		CASE(OUTPUT):
 			for(size_t i = 0; i < exprs.size(); i++){
-				env.output(exprs[i].eval(env), exprs[i].type(env));
+				env.output(exprs[i].eval(env), exprs[i].type.primtype);
 			}
 			env.out << '\n';
 			break;
 		CASE(IF):
-			expectTypeEqual(exprs[0].type(env), Primitive::BOOLEAN);
 			if(exprs[0].eval(env).b){
 				return blocks[0].eval(env);
 			} else if(blocks.size() == 2){ // if there is an ELSE statement
@@ -469,28 +322,19 @@ anylevelstmt:
 			break;
 		CASE(CASE):
 			{
-				const EType type = lvalues[0].type(env);
+				const SType& type = lvalues[0].type;
 				const EValue& val = lvalues[0].eval(env);
-				if(type.is_array){
-					throw TypeError("Cannot use array in CASE OF");
-				}
 				for(size_t i = 0; i < exprs.size(); i++){
 					bool result = false;
-					const EType exprtype = exprs[i].type(env);
-					if(exprtype.is_array){
-						throw TypeError("Cannot use array in CASE OF case");
-					}
-					if(isAnyOf(Primitive::REAL, type, exprtype) && type != exprtype){
+					const SType& exprtype = exprs[i].type;
+					if(isAnyOf(Primitive::REAL, type.primtype, exprtype.primtype) && type != exprtype){
 						// INTEGER, REAL or vice versa
 						if(type == Primitive::INTEGER){
 							result = (exprs[i].eval(env).frac == val.i64);
-						} else if(exprtype == Primitive::INTEGER){
+						} else /* if(exprtype == Primitive::INTEGER) */ {
 							result = (val.frac == exprs[i].eval(env).i64);
-						} else {
-							throw TypeError("Cannot convert condition to REAL");
 						}
 					} else {
-						expectTypeEqual(exprtype, type);
 						EValue exprval = exprs[i].eval(env);
 #define PRIM(t, n) case Primitive:: t: result = (exprval. n == val. n); break;
 						switch(type.primtype){
@@ -519,31 +363,19 @@ endcase:
 			break;
 		CASE(FOR):
 			{
-				EType types[3];
+				SType types[3];
 				bool is_frac = false;
 				for(size_t i = 0; i < exprs.size(); i++){
-					types[i] = exprs[i].type(env);
-					expectTypeEqual(types[i], Primitive::REAL, Primitive::INTEGER);
+					types[i] = exprs[i].type;
 					is_frac |= (types[i] == Primitive::REAL);
 				}
 				EValue vals[3];
 				for(size_t i = 0; i < exprs.size(); i++){
 					vals[i] = exprs[i].eval(env);
 				}
-				// Create the loop variable in scope and remove it later.
-				// Keep the old var for restoring later.
-				const EType old_type = env.getType(ids[0]);
-				EValue old_val;
-				int32_t old_call_frame = 0;
-				if(old_type != Primitive::INVALID){
-					old_val = env.getValue(ids[0]);
-					old_call_frame = env.getLevel(ids[0]);
-				}
-				// Delete the old one and put in our own.
-				env.deleteVar(ids[0]);
-				env.setType(ids[0], is_frac ? Primitive::REAL : Primitive::INTEGER);
-				env.setLevel(ids[0], env.call_number); // Assigns the scope. (See environment.hpp).
+				// The loop variable has its own slot in the frame.
 				// (We'll assign the value in the individual cases.)
+				EValue& var = env.frame.base[slot];
 
 				// The loop condition can change depending on how it is written.
 				// `FOR i <- 1 TO 10 STEP 2` => `for(i = 1; i <= 10; i += 2)`
@@ -569,12 +401,13 @@ endcase:
 					for(Fraction<> loopvar = vals[0].frac;
 						LOOPCOND(vals[0].frac, vals[1].frac, loopvar);
 						loopvar += step){
-						env.value(ids[0]) = loopvar;
+						var = loopvar;
 						const Expr *ret = blocks[0].eval(env);
 						if(ret != nullptr){
 							// The loop returned
 							return ret;
 						}
+						env.step();
 					}
 				} else {
 					// Integer for loop.
@@ -588,41 +421,41 @@ endcase:
 						auto loopvar = vals[0].i64;
 						LOOPCOND(vals[0].i64, vals[1].i64, loopvar);
 						loopvar += step){
-						env.value(ids[0]) = loopvar;
+						var = loopvar;
 						const Expr *ret = blocks[0].eval(env);
 						if(ret != nullptr){
 							// loop returned
 							return ret;
 						}
+						env.step();
 					}
 				}
 #undef LOOPCOND
-				// Restore the old variable.
-				env.deleteVar(ids[0]);
-				if(old_type != Primitive::INVALID){
-					env.setType(ids[0], old_type);
-					env.value(ids[0]) = old_val;
-					env.setLevel(ids[0], old_call_frame);
-				}
 			}
 			break;
 		CASE(REPEAT):
-			expectTypeEqual(exprs[0].type(env), Primitive::BOOLEAN);
-			do {
+			// A step is counted every time a loop goes back round,
+			// the same as the VM does on its backwards jumps.
+			for(;;){
 				const Expr *ret = blocks[0].eval(env);
 				if(ret != nullptr) return ret;
-			} while(!exprs[0].eval(env).b);
+				if(exprs[0].eval(env).b) break;
+				env.step();
+			}
 			break;
 		CASE(WHILE):
-			expectTypeEqual(exprs[0].type(env), Primitive::BOOLEAN);
 			while(exprs[0].eval(env).b){
 				const Expr *ret = blocks[0].eval(env);
 				if(ret != nullptr) return ret;
+				env.step();
 			}
 			break;
 		CASE(CALL):
 			// all the typechecking will be done for us
-			callFunc(env, ids[0], exprs);
+			{
+				const std::optional<EValue> retval = callFunc(env, func, exprs);
+				if(retval && env.functable[func]->ret_type.is_array) env.release(*retval);
+			}
 			break;
 		default:
 			// RETURN will be handled in Block::eval.
@@ -634,6 +467,7 @@ endcase:
 
 const Expr *Block::eval(Env& env) const {
 	for(const auto& stmt : stmts){
+		if(env.profiler != nullptr) env.profiler->line(stmt.line);
 		if(stmt.form == StmtForm::RETURN){
 			return &stmt.exprs[0];
 		}
@@ -648,7 +482,11 @@ const Expr *Block::eval(Env& env) const {
 }
 
 void Program::eval(Env& env) const {
+	env.init(global_count, frame_size);
+	env.useLiterals(*strings);
+	env.functable.assign(functions.begin(), functions.end());
 	for(const auto& stmt : stmts){
+		if(env.profiler != nullptr) env.profiler->line(stmt.line);
 		stmt.eval(env);
 	}
 }
@@ -127,7 +127,12 @@ inline std::string_view tokenTypeToStr(const TokenType type) noexcept {
 	return TokenTypeStrTable[static_cast<int>(type)];
 }
 
-const std::map<std::string_view, TokenType> reservedWords {
+struct ReservedWord {
+	std::string_view word;
+	TokenType type;
+};
+
+constexpr ReservedWord reserved_words[] = {
 #undef RESERVED
 #define RESERVED(a) { #a, TokenType:: a },
 	TOKENTYPE_LIST
@@ -135,10 +140,65 @@ const std::map<std::string_view, TokenType> reservedWords {
 #define RESERVED(a) /* nothing */
 };
 
+/* Finding out whether a word is reserved happens for every identifier,
+ * so it uses a perfect hash table:
+ * the seed is searched for at compile time so that no two reserved words
+ * land in the same slot, and then checking a word is one hash
+ * and (at most) one comparison. */
+namespace reserved_hash {
+	constexpr size_t TABLE_SIZE = 256;
+	constexpr uint32_t hash(const std::string_view s, const uint32_t seed) noexcept {
+		// FNV-1a
+		uint32_t h = 2166136261u ^ seed;
+		for(const char c : s){
+			h ^= static_cast<unsigned char>(c);
+			h *= 16777619u;
+		}
+		h ^= h >> 15;
+		return h & (TABLE_SIZE - 1);
+	}
+	constexpr uint32_t findSeed(){
+		for(uint32_t seed = 0; ; seed++){
+			bool used[TABLE_SIZE] = {};
+			bool ok = true;
+			for(const auto& r : reserved_words){
+				const uint32_t h = hash(r.word, seed);
+				if(used[h]){
+					ok = false;
+					break;
+				}
+				used[h] = true;
+			}
+			if(ok) return seed;
+		}
+	}
+	constexpr uint32_t seed = findSeed();
+	/* Empty slots have an empty word, which no identifier matches. */
+	struct Table {
+		ReservedWord slots[TABLE_SIZE] = {};
+	};
+	constexpr Table table = [](){
+		Table res;
+		for(const auto& r : reserved_words){
+			res.slots[hash(r.word, seed)] = r;
+		}
+		return res;
+	}();
+}
+
+/* Returns TokenType::IDENTIFIER if `word` isn't reserved. */
+constexpr TokenType reservedWordType(const std::string_view word) noexcept {
+	const ReservedWord& r = reserved_hash::table.slots[reserved_hash::hash(word, reserved_hash::seed)];
+	return r.word == word ? r.type : TokenType::IDENTIFIER;
+}
+
+static_assert(reservedWordType("ENDFUNCTION") == TokenType::ENDFUNCTION);
+static_assert(reservedWordType("endfunction") == TokenType::IDENTIFIER);
+
 const std::vector<bool> is_reserved_word = [](){
 	std::vector<bool> res(TOKENTYPE_LENGTH, false);
-	for(const auto& x : reservedWords){
-		res[static_cast<int>(x.second)] = true;
+	for(const auto& x : reserved_words){
+		res[static_cast<int>(x.type)] = true;
 	}
 	return res;
 }();
@@ -244,14 +304,25 @@ public:
 	LexError(size_t pos_, size_t line_, size_t col_, const T msg): std::runtime_error(msg), pos(pos_), line(line_), col(col_) {}
 };
 
+/* Lexes the whole source at once.
+ * It works over one contiguous buffer, either one you give it
+ * (e.g. a mmap'd file) or one it reads an istream into.
+ * The tokens don't point into the buffer,
+ * so it can go away once the Lexer's done.
+ * STR_C tokens point into `strings` instead, so the Lexer has to outlive its tokens,
+ * but not the Program parsed from them. */
 class Lexer {
 public:
-	std::istream& in;
 	std::vector<Token> output;
 	std::vector<size_t> line_loc;
 	int64_t identifier_count = 0;
 	std::map<std::string_view, int64_t> id_num;
+	StringStore strings; /* what the STR_C tokens and id_num point into */
 protected:
+	std::string buf; /* only used if we were given an istream */
+	const char *src;
+	size_t len;
+	bool eof = false; /* whether we've tried to read past the end */
 	size_t line = 1;
 	size_t curr = 0;
 
@@ -303,20 +374,17 @@ protected:
 		output.emplace_back(line, getCol(startpos), type, lt);
 	}
 	inline bool done() const  {
-		return in.eof();
+		return eof;
 	}
 	inline char peek() const  {
-		return in.eof() ? '\0' : in.peek();
+		return curr == len ? '\0' : src[curr];
 	}
 	inline char next()  {
-		char c;
-		in.get(c);
-		if(in.eof()){
-			c = '\0';
-		} else {
-			++curr;
+		if(curr == len){
+			eof = true;
+			return '\0';
 		}
-		return c;
+		return src[curr++];
 	}
 	inline bool match(const char c)  {
 		if(c == peek()){
@@ -342,21 +410,19 @@ protected:
 		line_loc.push_back(curr - 1);
 		line++;
 	}
-	inline void number(char c){
+	inline void number(){
 		// Integer or Real
 		const size_t start = curr - 1;
-		std::string numstr;
-		numstr += c;
-		numstr.reserve(std::max(MAX_FRAC_NUM_STR.length(), MAX_INT_STR.length()));
-		while(isDigit(peek())) numstr.push_back(next());
+		while(isDigit(peek())) next();
 		if(peek() == '.'){
 			// Real
-			numstr.push_back(next());
+			next();
 			if(!isDigit(peek())){
 				error("Expected digit after decimal point");
 			}
-			numstr.push_back(next());
-			while(isDigit(peek())) numstr.push_back(next());
+			next();
+			while(isDigit(peek())) next();
+			const std::string_view numstr(src + start, curr - start);
 			if(numstr.size() >= MAX_FRAC_NUM_STR.length()){
 				error("Real constant too large");
 			}
@@ -375,6 +441,7 @@ protected:
 				next();
 				error("Unexpected character after number");
 			}
+			const std::string_view numstr(src + start, curr - start);
 			// check if is too big
 			// (stupid check so that math using it doesn't overflow easily)
 			if(numstr.size() >= MAX_INT_STR.length()){
@@ -394,30 +461,28 @@ protected:
 	}
 	inline void string(){
 		const size_t start = curr - 1;
-		std::string res;
 		while(!done() && peek() != '"'){
-			res += next();
-			if(res.back() == '\n') newline();
+			if(next() == '\n') newline();
 		}
 		// will throw if the string is incomplete
 		expect('"');
-		emit(TokenType::STR_C, global::toStrView(res), start);
+		// Equal literals share their characters.
+		emit(TokenType::STR_C, std::string_view(strings.internCopy(std::string_view(src + start + 1, curr - start - 2))), start);
 	}
-	inline void identifier(char c){
+	inline void identifier(){
 		const size_t start = curr-1;
-		std::string id;
-		id += c;
 		// var names match /[A-Za-z][A-Za-z0-9_]*/
-		while(isAlpha(peek()) || isDigit(peek()) || peek() == '_') id.push_back(next());
-		if(reservedWords.find(id) != reservedWords.end()){
-			emit(reservedWords.at(id), 0, start);
+		while(isAlpha(peek()) || isDigit(peek()) || peek() == '_') next();
+		const std::string_view id(src + start, curr - start);
+		if(const TokenType type = reservedWordType(id); type != TokenType::IDENTIFIER){
+			emit(type, 0, start);
 		} else {
 			int64_t idn = identifier_count + 1;
 			auto it = id_num.find(id);
 			if(it != id_num.end()){
 				idn = it->second;
 			} else {
-				id_num.insert(it, { global::toStrView(id), idn });
+				id_num.insert(it, { strings.add(std::string(id)), idn });
 				identifier_count++;
 			}
 			emit(TokenType::IDENTIFIER, idn, start);
@@ -487,9 +552,9 @@ protected:
 					break;
 				default:
 					if(isDigit(c))
-						number(c);
+						number();
 					else if(isAlpha(c))
-						identifier(c);
+						identifier();
 					else {
 						std::string msg = "Stray ";
 						msg += c;
@@ -536,12 +601,22 @@ protected:
 	}
 	// }}}
 public:
-	inline Lexer(std::istream& src): in(src) {
-		in.exceptions(std::istream::badbit);
+	/* `source` only has to live as long as the constructor runs. */
+	inline Lexer(const std::string_view source): src(source.data()), len(source.size()) {
 		lex();
 		// add an EOF token
 		emit(TokenType::INVALID, 0, curr);
 	}
+	inline Lexer(std::istream& in) {
+		in.exceptions(std::istream::badbit);
+		std::ostringstream ss;
+		ss << in.rdbuf();
+		buf = std::move(ss).str();
+		src = buf.data();
+		len = buf.size();
+		lex();
+		emit(TokenType::INVALID, 0, curr);
+	}
 };
 
 // }}}
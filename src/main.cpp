@@ -1,12 +1,184 @@
 #include <iostream>
 #include <vector>
+#include <map>
+#include <memory>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <charconv>
 #include "interpreter.hpp"
+#include "compiler.hpp"
+#include "vm.hpp"
+#include "mapped_file.hpp"
+#include "cache.hpp"
+
+// Batch mode {{{
+/* A source file from the batch list. It's lexed, parsed, checked (and compiled) once,
+ * and after that the Program and Chunk are only read,
+ * so every input for it can run at the same time, each with its own Env. */
+struct BatchProgram {
+	std::string source;
+	std::unique_ptr<MappedFile> file;
+	std::unique_ptr<Lexer> lexer;
+	std::unique_ptr<Parser> parser;
+	std::unique_ptr<Compiler> compiler;
+	bool loaded = false; /* false if the file couldn't be read */
+	std::string error; /* if it failed before running */
+	std::string crash; /* same as BatchJob::crash */
+};
+
+/* One line of the batch list: run a program with `input` on stdin,
+ * and check it prints exactly `expected`. */
+struct BatchJob {
+	size_t program;
+	std::string input, expected;
+	bool passed = false;
+	std::string crash; /* what went wrong, if it wasn't an error from the program */
+};
+
+/* Errors go into the output the same way the .err files in test/invalid-files have them,
+ * so both kinds of test file can be used. */
+#define CATCH(err) catch(err& e){ out << #err ": " << e.what() << '\n'; }
+/* Anything else (running out of memory, a bug in pcse) fails just the one job, with `crash` saying why.
+ * It can't be allowed out of the worker thread, since that would end the whole batch. */
+#define CATCH_ALL(crash) \
+	catch(std::exception& e){ crash = e.what(); } \
+	catch(...){ crash = "unknown exception"; }
+
+static void prepare(BatchProgram& prog, bool tree_walk){
+	prog.file = std::make_unique<MappedFile>(prog.source.c_str());
+	if(!prog.file->ok) return;
+	prog.loaded = true;
+	std::ostringstream out;
+	try {
+		prog.lexer = std::make_unique<Lexer>(prog.file->view());
+		prog.parser = std::make_unique<Parser>(prog.lexer->output);
+		TypeChecker checker(*prog.parser->output, prog.lexer->id_num);
+		if(!tree_walk) prog.compiler = std::make_unique<Compiler>(*prog.parser->output, checker);
+	} CATCH(LexError) CATCH(ParseError) CATCH(TypeError) CATCH(RuntimeError)
+	CATCH_ALL(prog.crash);
+	prog.error = out.str();
+}
+
+static void runJob(BatchJob& job, const BatchProgram& prog, bool tree_walk, const Env::Limits& limits){
+	const MappedFile expected(job.expected.c_str());
+	if(!prog.loaded || !expected.ok) return;
+	if(!prog.crash.empty()){
+		job.crash = prog.crash;
+		return;
+	}
+	std::ostringstream out;
+	if(!prog.error.empty()){
+		out << prog.error;
+	} else {
+		std::istringstream in;
+		if(job.input != "-"){
+			const MappedFile input(job.input.c_str());
+			if(!input.ok) return;
+			in.str(std::string(input.view()));
+		}
+		try {
+			Env env(in, out);
+			env.setLimits(limits);
+			if(tree_walk){
+				prog.parser->run(env);
+			} else {
+				VM vm(prog.compiler->output, env);
+				vm.run();
+			}
+		} CATCH(TypeError) CATCH(RuntimeError)
+		CATCH_ALL(job.crash);
+	}
+	job.passed = job.crash.empty() && (out.str() == expected.view());
+}
+#undef CATCH_ALL
+#undef CATCH
+
+/* Calls f(0) ... f(n-1) spread over `threads` threads. */
+template<typename F>
+static void parallelFor(size_t n, size_t threads, const F& f){
+	std::atomic<size_t> next = 0;
+	std::vector<std::thread> pool(threads);
+	for(auto& t : pool){
+		t = std::thread([&](){
+			for(size_t i; (i = next++) < n;) f(i);
+		});
+	}
+	for(auto& t : pool) t.join();
+}
+
+/* Runs every job listed in `listname` (one `SOURCE INPUT EXPECTED` per line, INPUT can be `-`)
+ * across all the cores, in one process. Each distinct SOURCE is only parsed once. */
+static int runBatch(const char *listname, bool tree_walk, const Env::Limits& limits){
+	std::ifstream list(listname);
+	if(!list){
+		std::cerr << "File does not exist!\n";
+		return EXIT_FAILURE;
+	}
+	std::vector<BatchProgram> programs;
+	std::vector<BatchJob> jobs;
+	{
+		std::map<std::string, size_t> program_ids;
+		std::string source;
+		BatchJob job;
+		while(list >> source >> job.input >> job.expected){
+			auto [it, inserted] = program_ids.try_emplace(source, programs.size());
+			if(inserted){
+				programs.emplace_back();
+				programs.back().source = source;
+			}
+			job.program = it->second;
+			jobs.push_back(job);
+		}
+	}
+	const size_t threads = std::max(1u, std::thread::hardware_concurrency());
+	const auto start = std::chrono::steady_clock::now();
+	parallelFor(programs.size(), threads, [&](size_t i){ prepare(programs[i], tree_walk); });
+	parallelFor(jobs.size(), threads, [&](size_t i){ runJob(jobs[i], programs[jobs[i].program], tree_walk, limits); });
+	const double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+	size_t passed = 0;
+	for(const auto& job : jobs){
+		if(job.passed) passed++;
+		else {
+			std::cerr << "FAIL " << programs[job.program].source << " with " << job.input;
+			if(!job.crash.empty()) std::cerr << ": " << job.crash;
+			std::cerr << '\n';
+		}
+	}
+	std::cerr << passed << '/' << jobs.size() << " passed in " << secs << "s ("
+		<< jobs.size() / secs << " runs/s, " << programs.size() << " programs, " << threads << " threads)\n";
+	return passed == jobs.size() ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+// }}}
+
+/* A number of bytes, optionally with a K, M or G after it. */
+static bool parseBytes(std::string_view str, size_t& res){
+	auto [ptr, ec] = std::from_chars(str.data(), str.data() + str.size(), res);
+	if(ec != std::errc() || ptr == str.data()) return false;
+	const std::string_view suffix(ptr, str.data() + str.size() - ptr);
+	if(suffix.empty()) return true;
+	if(suffix.size() != 1) return false;
+	switch(suffix[0]){
+		case 'G': res *= 1024; [[fallthrough]];
+		case 'M': res *= 1024; [[fallthrough]];
+		case 'K': res *= 1024; return true;
+		default: return false;
+	}
+}
 
 int main(int argc, char *argv[]){
 	const char *filename = nullptr;
+	const char *batch = nullptr;
+	const char *cache_dir = nullptr;
 	bool print_tokens = false;
 	bool print_tree = false;
 	bool print_line = false;
+	bool print_bytecode = false;
+	bool tree_walk = false;
+	bool profile = false;
+	bool memory_stats = false;
+	Env::Limits limits;
 	for(int i = 1; i < argc; i++){
 		std::string_view arg(argv[i]);
 		if(!arg.size()) goto fail;
@@ -18,13 +190,46 @@ int main(int argc, char *argv[]){
 					"Options:\n"
 					"--print-tokens: Print the token list of the file.\n"
 					"--print-tree: Print the syntax tree of the file.\n"
+					"--print-bytecode: Print the compiled bytecode of the file.\n"
+					"--tree-walk: Run the syntax tree directly instead of compiling it (slower, for reference).\n"
+					"--profile: Print how many times each line ran and how long it took, once the program ends.\n"
+					"--memory-stats: Print how many bytes of arrays and input were live at the end and at most, once the program ends.\n"
+					"--cache DIR: Keep the compiled program in DIR, and reuse it if FILE hasn't changed.\n"
+					"             DIR has to be yours and not writable by anyone else, or it isn't used.\n"
+					"--batch LIST: Instead of FILE, run every `SOURCE INPUT EXPECTED` line of LIST in parallel\n"
+					"              and check the output (INPUT can be - for no input).\n"
+					"--max-steps N: Stop after N loop iterations and function calls (exit code %d).\n"
+					"--max-memory BYTES: Stop if arrays and input take more than BYTES, which can end in K, M or G (exit code %d).\n"
+					"--time-limit SECONDS: Stop after SECONDS (exit code %d).\n"
 					"-h, --help: Print help.\n",
-					argv[0]);
+					argv[0], StepLimitError::exit_code, MemoryLimitError::exit_code, TimeLimitError::exit_code);
 				exit(EXIT_SUCCESS);
 			} else if(arg == "--print-tokens"){
 				print_tokens = true;
 			} else if(arg == "--print-tree"){
 				print_tree = true;
+			} else if(arg == "--print-bytecode"){
+				print_bytecode = true;
+			} else if(arg == "--tree-walk"){
+				tree_walk = true;
+			} else if(arg == "--profile"){
+				profile = true;
+			} else if(arg == "--memory-stats"){
+				memory_stats = true;
+			} else if(arg == "--cache" && i + 1 < argc){
+				cache_dir = argv[++i];
+			} else if(arg == "--batch" && i + 1 < argc){
+				batch = argv[++i];
+			} else if(arg == "--max-steps" && i + 1 < argc){
+				const std::string_view num(argv[++i]);
+				auto [ptr, ec] = std::from_chars(num.data(), num.data() + num.size(), limits.steps);
+				if(ec != std::errc() || ptr != num.data() + num.size()) goto fail;
+			} else if(arg == "--max-memory" && i + 1 < argc){
+				if(!parseBytes(argv[++i], limits.memory)) goto fail;
+			} else if(arg == "--time-limit" && i + 1 < argc){
+				char *end;
+				limits.seconds = strtod(argv[++i], &end);
+				if(*end != '\0' || !(limits.seconds >= 0)) goto fail;
 			} else if(arg == "-l"){
 				print_line = true;
 			} else {
@@ -43,13 +248,16 @@ fail:
 		fprintf(stderr, "Usage: %s [OPTIONS...] FILE\n", argv[0]);
 		exit(EXIT_FAILURE);
 	}
+	if(batch != nullptr){
+		return runBatch(batch, tree_walk, limits);
+	}
 	if(filename == nullptr){
 		fprintf(stderr, "No file specified!\n");
 		exit(EXIT_FAILURE);
 	}
 	// read all from file
-	std::ifstream in(filename, std::ios::in);
-	if(!in){
+	const MappedFile in(filename);
+	if(!in.ok){
 		std::cerr << "File does not exist!\n";
 		exit(EXIT_FAILURE);
 	}
@@ -62,9 +270,57 @@ fail:
 	catch(name &e) { \
 		CATCH_B(name) \
 	}
+
+#define CATCH_LIMIT(name) \
+	catch(name &e) { \
+		std::cerr << #name << ": " << e.what() << '\n'; \
+		return name::exit_code; \
+	}
 	
+	/* The report goes out however the program ends (even with an error),
+	 * which is when this goes out of scope. */
+	struct ProfileReport {
+		Profiler *profiler;
+		std::string_view src;
+		~ProfileReport(){
+			if(profiler == nullptr) return;
+			profiler->stop();
+			profiler->report(std::cerr, src);
+		}
+	};
+	Profiler profiler;
+	const ProfileReport report = { profile ? &profiler : nullptr, in.view() };
+	/* Same for --memory-stats. It's declared after the Env, so it goes before the Env frees what's left. */
+	struct MemoryReport {
+		const Env *env;
+		~MemoryReport(){
+			if(env == nullptr) return;
+			const Env::MemoryStats stats = env->memoryStats();
+			std::cerr << "Live bytes: " << stats.live_bytes << " (in " << stats.arrays << " arrays)\n"
+				<< "Peak bytes: " << stats.peak_bytes << '\n';
+		}
+	};
+
 	try {
-		Lexer lexer(in);
+		// The cache only has the bytecode, so it's no use for anything that wants the tokens or tree
+		// (and there aren't any LINE instructions in it for the profiler).
+		std::string cache_file;
+		if(cache_dir != nullptr && !tree_walk && !print_tokens && !print_tree && !profile){
+			cache_file = cache::path(cache_dir, in.view());
+			Chunk chunk;
+			if(cache::load(cache_file, in.view(), chunk)){
+				if(print_bytecode){
+					std::cerr << chunk;
+				}
+				Env env;
+				const MemoryReport memory_report = { memory_stats ? &env : nullptr };
+				env.setLimits(limits);
+				VM vm(chunk, env);
+				vm.run();
+				return EXIT_SUCCESS;
+			}
+		}
+		Lexer lexer(in.view());
 		if(print_tokens){
 			for(const auto& token : lexer.output){
 				std::cerr << token << '\n';
@@ -74,8 +330,25 @@ fail:
 		if(print_tree){
 			std::cerr << *parser.output << '\n';
 		}
-		Env env(lexer.identifier_count, lexer.id_num);
-		parser.run(env);
+		TypeChecker checker(*parser.output, lexer.id_num);
+		Env env;
+		const MemoryReport memory_report = { memory_stats ? &env : nullptr };
+		env.profiler = report.profiler;
+		if(tree_walk){
+			env.setLimits(limits);
+			parser.run(env);
+		} else {
+			Compiler compiler(*parser.output, checker, profile);
+			if(print_bytecode){
+				std::cerr << compiler.output;
+			}
+			if(!cache_file.empty()){
+				cache::store(cache_file, compiler.output, in.view());
+			}
+			env.setLimits(limits);
+			VM vm(compiler.output, env);
+			vm.run();
+		}
 	} catch(std::istream::failure& e){ 
 		std::cerr << "File error: Failure to read file\n";
 		std::cerr << "istream::failure::what(): " << e.what() << '\n';
@@ -86,7 +359,9 @@ fail:
 	} catch(ParseError& e){
 		if(print_line) std::cerr << e.token.line << ':' << e.token.col << '\n';
 		CATCH_B(ParseError);
-	} CATCH(TypeError) CATCH(RuntimeError);
+	} CATCH(TypeError)
+	CATCH_LIMIT(StepLimitError) CATCH_LIMIT(MemoryLimitError) CATCH_LIMIT(TimeLimitError)
+	CATCH(RuntimeError);
 
 	return EXIT_SUCCESS;
 }
@@ -0,0 +1,77 @@
+#ifndef MAPPED_FILE_HPP
+#define MAPPED_FILE_HPP
+
+#include <string>
+#include <string_view>
+#include <fstream>
+#include <sstream>
+
+#if defined(__unix__) || defined(__APPLE__)
+#define PCSE_HAVE_MMAP
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+/* The whole contents of a file, for the Lexer.
+ * It's mmap'd if possible, otherwise it just gets read into memory
+ * (e.g. for pipes, or on Windows). */
+class MappedFile {
+	const char *data = nullptr;
+	size_t size = 0;
+	bool mapped = false;
+	std::string buf;
+public:
+	bool ok = false; /* false if the file couldn't be opened */
+	explicit MappedFile(const char *filename){
+#ifdef PCSE_HAVE_MMAP
+		const int fd = open(filename, O_RDONLY);
+		if(fd < 0) return;
+		map(fd);
+		close(fd);
+		if(mapped) return;
+#endif
+		std::ifstream in(filename, std::ios::in | std::ios::binary);
+		if(!in) return;
+		std::ostringstream ss;
+		ss << in.rdbuf();
+		buf = std::move(ss).str();
+		data = buf.data();
+		size = buf.size();
+		ok = true;
+	}
+#ifdef PCSE_HAVE_MMAP
+	/* A file that's already open (and stays open; it's up to the caller to close it).
+	 * Only regular files that aren't empty work. */
+	explicit MappedFile(int fd){
+		map(fd);
+	}
+#endif
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator=(const MappedFile&) = delete;
+	~MappedFile(){
+#ifdef PCSE_HAVE_MMAP
+		if(mapped) munmap((void *)data, size);
+#endif
+	}
+	inline std::string_view view() const noexcept {
+		return std::string_view(data, size);
+	}
+private:
+#ifdef PCSE_HAVE_MMAP
+	inline void map(int fd){
+		struct stat st;
+		if(fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0){
+			void *p = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+			if(p != MAP_FAILED){
+				data = (const char *)p;
+				size = st.st_size;
+				mapped = ok = true;
+			}
+		}
+	}
+#endif
+};
+
+#endif /* MAPPED_FILE_HPP */
@@ -0,0 +1,123 @@
+#ifndef OPERATORS_HPP
+#define OPERATORS_HPP
+
+#include "parser.hpp"
+
+/* The binary operators for the tree-walker, one function for every combination of operand types.
+ * The TypeChecker picks one for each Expr (with ops::binary()),
+ * so evaluating an operator is a single indirect call that doesn't look at the types.
+ * AND and OR aren't here, since they short-circuit. */
+
+namespace ops {
+
+using Fn = EValue (*)(EValue, EValue);
+
+// Operands {{{
+
+template<Primitive P> struct Operand;
+template<> struct Operand<Primitive::INTEGER> { static int64_t get(const EValue v){ return v.i64; } };
+template<> struct Operand<Primitive::REAL> { static Fraction<> get(const EValue v){ return v.frac; } };
+template<> struct Operand<Primitive::CHAR> { static char get(const EValue v){ return v.c; } };
+template<> struct Operand<Primitive::BOOLEAN> { static bool get(const EValue v){ return v.b; } };
+template<> struct Operand<Primitive::STRING> { static EString get(const EValue v){ return v.str; } };
+template<> struct Operand<Primitive::DATE> { static Date get(const EValue v){ return v.date; } };
+/* An INTEGER on one side of a REAL. */
+struct IntAsReal { static Fraction<> get(const EValue v){ return Fraction<>(v.i64); } };
+
+using Int = Operand<Primitive::INTEGER>;
+using Real = Operand<Primitive::REAL>;
+
+// }}}
+
+// The operators {{{
+
+#define BINOP(name, op) \
+	template<typename L, typename R> \
+	EValue name(const EValue l, const EValue r){ return L::get(l) op R::get(r); }
+BINOP(add, +)
+BINOP(sub, -)
+BINOP(mul, *)
+BINOP(div, /)
+BINOP(eq, ==)
+BINOP(ne, !=)
+BINOP(lt, <)
+BINOP(le, <=)
+BINOP(gt, >)
+BINOP(ge, >=)
+#undef BINOP
+
+inline EValue intDiv(const EValue l, const EValue r){
+	if(r.i64 == 0) throw RuntimeError("Cannot divide by zero");
+	return l.i64 / r.i64;
+}
+
+inline EValue intMod(const EValue l, const EValue r){
+	if(r.i64 == 0) throw RuntimeError("Cannot divide by zero");
+	return l.i64 % r.i64;
+}
+
+// }}}
+
+// ops::binary {{{
+
+template<typename L, typename R>
+inline Fn comparison(const TokenType op){
+	switch(op){
+		case TokenType::EQ: return eq<L, R>;
+		case TokenType::LT_GT: return ne<L, R>;
+		case TokenType::LT: return lt<L, R>;
+		case TokenType::LT_EQ: return le<L, R>;
+		case TokenType::GT: return gt<L, R>;
+		case TokenType::GT_EQ: return ge<L, R>;
+		default: throw RuntimeError("Invalid operator for comparison expr. (INTERNAL ERROR)");
+	}
+}
+
+template<typename L, typename R>
+inline Fn arithmetic(const TokenType op){
+	switch(op){
+		case TokenType::PLUS: return add<L, R>;
+		case TokenType::MINUS: return sub<L, R>;
+		case TokenType::STAR: return mul<L, R>;
+		default: throw RuntimeError("Invalid operator for math expr. (INTERNAL ERROR)");
+	}
+}
+
+/* The operator `op` for operands of types `l` and `r`, which the TypeChecker has already allowed. */
+inline Fn binary(const TokenType op, const Primitive l, const Primitive r){
+	using P = Primitive;
+	const int level = binaryLevel(op);
+	if(level == 2){
+		// INTEGERs get converted to REALs to compare with REALs.
+		if(l == P::REAL && r == P::INTEGER) return comparison<Real, IntAsReal>(op);
+		if(l == P::INTEGER && r == P::REAL) return comparison<IntAsReal, Real>(op);
+		switch(l){
+			case P::INTEGER: return comparison<Int, Int>(op);
+			case P::REAL: return comparison<Real, Real>(op);
+			case P::CHAR: return comparison<Operand<P::CHAR>, Operand<P::CHAR>>(op);
+			case P::BOOLEAN: return comparison<Operand<P::BOOLEAN>, Operand<P::BOOLEAN>>(op);
+			case P::STRING: return comparison<Operand<P::STRING>, Operand<P::STRING>>(op);
+			case P::DATE: return comparison<Operand<P::DATE>, Operand<P::DATE>>(op);
+			default: throw RuntimeError("Invalid types! (INTERNAL ERROR)");
+		}
+	}
+	switch(op){
+		case TokenType::SLASH:
+			// always a REAL
+			if(l == P::INTEGER) return r == P::INTEGER ? div<IntAsReal, IntAsReal> : div<IntAsReal, Real>;
+			return r == P::INTEGER ? div<Real, IntAsReal> : div<Real, Real>;
+		case TokenType::DIV: return intDiv;
+		case TokenType::MOD: return intMod;
+		default:
+			// REAL op INTEGER uses the Fraction's INTEGER overloads,
+			// but INTEGER op REAL has to convert the left side.
+			if(l == P::INTEGER) return r == P::INTEGER ? arithmetic<Int, Int>(op) : arithmetic<IntAsReal, Real>(op);
+			return r == P::INTEGER ? arithmetic<Real, Int>(op) : arithmetic<Real, Real>(op);
+	}
+}
+
+// }}}
+
+} // namespace ops
+
+#endif /* OPERATORS_HPP */
@@ -0,0 +1,81 @@
+#ifndef OUT_BUFFER_HPP
+#define OUT_BUFFER_HPP
+
+#include <charconv>
+#include <ostream>
+#include <string>
+#include <string_view>
+#include "date.hpp"
+
+/* Where OUTPUT goes.
+ * Values are formatted straight into one big buffer, which is only handed to the sink
+ * when it fills up, before an INPUT (so the prompt shows up first), and when it's destroyed.
+ * Without a sink it keeps everything, and str() gives it back (for the tests). */
+class OutBuffer {
+	static constexpr size_t SIZE = 1 << 16;
+	std::string buf;
+	std::ostream *sink;
+
+	inline void check(){
+		if(sink != nullptr && buf.size() >= SIZE) flush();
+	}
+	template<typename T>
+	inline void number(T x){
+		char tmp[32];
+		const auto res = std::to_chars(tmp, tmp + sizeof(tmp), x);
+		buf.append(tmp, res.ptr - tmp);
+	}
+public:
+	explicit OutBuffer(std::ostream *sink_ = nullptr) : sink(sink_) {
+		buf.reserve(SIZE + 64);
+	}
+	OutBuffer(const OutBuffer&) = delete;
+	OutBuffer& operator=(const OutBuffer&) = delete;
+	~OutBuffer(){
+		flush();
+	}
+	inline void flush(){
+		if(sink == nullptr || buf.empty()) return;
+		sink->write(buf.data(), buf.size());
+		sink->flush();
+		buf.clear();
+	}
+	inline std::string str() const {
+		return buf;
+	}
+
+	inline OutBuffer& operator<<(const char c){
+		buf.push_back(c);
+		check();
+		return *this;
+	}
+	inline OutBuffer& operator<<(const std::string_view str){
+		buf.append(str);
+		check();
+		return *this;
+	}
+	inline OutBuffer& operator<<(const int64_t x){
+		number(x);
+		check();
+		return *this;
+	}
+	/* The same as what `std::ostream << double` gives (%g). */
+	inline OutBuffer& operator<<(const double x){
+		char tmp[32];
+		const auto res = std::to_chars(tmp, tmp + sizeof(tmp), x, std::chars_format::general, 6);
+		buf.append(tmp, res.ptr - tmp);
+		check();
+		return *this;
+	}
+	inline OutBuffer& operator<<(const Date date){
+		number(static_cast<int>(date.day));
+		buf.push_back('/');
+		number(static_cast<int>(date.month));
+		buf.push_back('/');
+		number(static_cast<int>(date.year));
+		check();
+		return *this;
+	}
+};
+
+#endif /* OUT_BUFFER_HPP */
@@ -4,6 +4,7 @@
 #include <map>
 #include <vector>
 #include "lexer.hpp"
+#include "arena.hpp"
 #include "environment.hpp"
 
 class ParseError : public std::runtime_error {
@@ -28,11 +29,13 @@ class Program;
 class Parser {
 public:
 	std::vector<Token> tokens;
+	/* Owns every node of `output`, so the whole tree goes away in one go. */
+	Arena arena;
 	Program *output;
+	StringStore strings; /* the string literals in `output`, interned */
 	size_t curr = 0;
 	inline Parser(const std::vector<Token> tokens_) : tokens(tokens_) { parse(); }
 	inline Parser(const std::vector<Token>&& tokens_) : tokens(std::move(tokens_)) { parse(); }
-	inline ~Parser();
 	inline bool done() const noexcept {
 		// eof token
 		return curr >= tokens.size() - 1;
@@ -90,7 +93,7 @@ public:
 	}
 
 	void parse();
-	void run(Env& env);
+	void run(Env& env) const;
 };
 
 // }}}
@@ -99,47 +102,20 @@ public:
 
 // Expr, Type, Param, Primary, LValue {{{
 
-template<uint16_t Level>
-class BinExpr;
-
-using Expr = BinExpr<0>;
+class Expr;
 std::ostream& operator<<(std::ostream& os, const Expr& expr) noexcept;
 
 class LValue {
 public:
 	int64_t id;
-	std::vector<Expr> *indexes = nullptr;
+	ArenaVec<Expr> *indexes = nullptr;
+	SType type; /* filled in by the TypeChecker */
+	Slot slot; /* same */
 	LValue(Parser& p, int64_t id = 0);
-	/* copy */ LValue(LValue& l) = delete;
-	/* move */ LValue(LValue&& l) noexcept : id(l.id), indexes(l.indexes) {
-		l.indexes = nullptr;
-	}
-	LValue& operator=(LValue&& l) noexcept {
-		id = l.id;
-		indexes = l.indexes;
-		l.indexes = nullptr;
-		return *this;
-	}
 	EValue& ref(Env& env) const;
 	EValue eval(Env& env) const;
-	inline EType type(const Env& env) const {
-		const EType& type = env.getType(id);
-		if(indexes == nullptr) return type;
-		if(!type.is_array){
-			throw TypeError("Cannot index a non-array");
-		}
-		// How many indexes deep are we?
-		size_t depth = indexes->size();
-		std::vector<std::pair<int64_t,int64_t>> new_bounds(type.bounds.size() - depth);
-		for(size_t i = 0; i < new_bounds.size(); i++){
-			new_bounds[i] = type.bounds[i + depth];
-		}
-		return EType(/* is an array if new_bounds isn't empty */ new_bounds.size(), new_bounds, type.primtype);
-	}
-	~LValue() {
-		/* Deleting a nullptr is safe. */
-		delete indexes;
-	}
+	void assign(Env& env, EValue val) const;
+	void input(Env& env) const;
 	// Friend operator<< {{{
 	friend std::ostream& operator<<(std::ostream& os, const LValue& lv){
 		os << '~' << lv.id;
@@ -158,31 +134,30 @@ public:
 	struct All {
 		// Valid values: 
 		// STR_C, INT_C, REAL_C, CHAR_C, IDENTIFIER [lvalue], 
-		// TRUE, FALSE, CALL [function call], INVALID [(expr)]
+		// TRUE, FALSE, CALL [function call]
 		TokenType primtype;
 		int64_t func_id;
+		uint32_t func = 0; /* CALL: the function's number (see Program::functions), filled in by the TypeChecker */
+		EString str{}; /* STR_C: what it evaluates to (interned in Parser::strings) */
 		union Main {
 			LValue lvalue;
 			Token::Literal lt;
-			Expr *expr;
-			std::vector<Expr> *args;
+			ArenaVec<Expr> *args;
 			inline Main(Token::Literal lt_) : lt(lt_) {}
 			inline Main(int i): lt(i) {}
 			Main() {}
 			~Main() {}
 		} main;
 	} all;
+	SType type; /* filled in by the TypeChecker */
 	const All::Main& main() const noexcept { return all.main; }
 	TokenType primtype() const noexcept { return all.primtype; }
 	Primary(Parser& p);
 	/* copy */ Primary(Primary& pri) = delete;
-	/* move */ Primary(Primary&& pri) noexcept {
+	/* move */ Primary(Primary&& pri) noexcept : type(pri.type) {
 		std::memcpy(&all, &pri.all, sizeof(All));
-		pri.all.main.expr = nullptr;
 	}
-	~Primary();
 	EValue eval(Env& env) const;
-	EType type(Env& env) const;
 	// friend operator<< {{{
 	/* make easier to debug */
 	friend std::ostream& operator<<(std::ostream& os, const Primary& p) noexcept {
@@ -215,9 +190,6 @@ public:
 				}
 				os << ')';
 				break;
-			CASE(INVALID):
-				os << '(' << *p.main().expr << ')';
-				break;
 			CASE(IDENTIFIER):
 				os << p.main().lvalue;
 				break;
@@ -236,62 +208,7 @@ static const std::vector<TokenType> unary_ops = {
 	TokenType::MINUS
 };
 
-class UnaryExpr {
-public:
-	const TokenType op;
-	union Main {
-		Primary *primary;
-		UnaryExpr *unexpr;
-		Main(Primary *p) : primary(p) {}
-		Main(UnaryExpr *e): unexpr(e) {}
-	} main;
-	static TokenType make_op(Parser& p) {
-		for(const auto type : unary_ops){
-			if(p.match_type(type)){
-				return type;
-			}
-		}
-		return TokenType::INVALID;
-	}
-	static Main make_main(TokenType op, Parser& p){
-		if(op == TokenType::INVALID){
-			return new Primary(p);
-		} else {
-			return new UnaryExpr(p);
-		}
-	}
-	UnaryExpr(Parser& p) : op(make_op(p)), main(make_main(op, p)) {}
-	/* copy */ UnaryExpr(UnaryExpr& un) = delete;
-	/* move */ UnaryExpr(UnaryExpr&& un) noexcept : op(un.op), main(un.main) {
-		un.main.primary = nullptr;
-	}
-	~UnaryExpr() {
-		if(op == TokenType::INVALID){
-			delete main.primary;
-		} else {
-			delete main.unexpr;
-		}
-	}
-	EValue eval(Env& env) const;
-	inline EType type(Env& env) const {
-		return (op == TokenType::INVALID ? main.primary->type(env) : main.unexpr->type(env));
-	}
-	// friend operator<< {{{
-	friend std::ostream& operator<<(std::ostream& os, const UnaryExpr& un) noexcept {
-		os << '{';
-		if(un.op == TokenType::INVALID){
-			os << *un.main.primary;
-		} else {
-			os 	<< (un.op == TokenType::NOT ?
-					"NOT" : "-")
-				<< *un.main.unexpr;
-		}
-		os << '}';
-		return os;
-	}
-	// }}}
-};
-
+/* From the loosest binding to the tightest. */
 const std::vector<TokenType> binary_ops[] = {
 	{ TokenType::OR },
 	{ TokenType::AND },
@@ -300,52 +217,69 @@ const std::vector<TokenType> binary_ops[] = {
 	{ TokenType::STAR, TokenType::SLASH, TokenType::MOD, TokenType::DIV },
 };
 
-const uint16_t MAX_BINARY_LEVEL = 4;
-
-template<uint16_t Level>
-class BinExpr {
-	static_assert(Level <= MAX_BINARY_LEVEL);
-public:
-	using LowerExpr = typename std::conditional<(Level < MAX_BINARY_LEVEL), BinExpr<Level+1>, UnaryExpr>::type;
-
-	LowerExpr left;
-	struct Opt {
-		TokenType op;
-		BinExpr<Level> *right;
-	} opt;
-
-	static Opt make_opt(Parser& p){
-		for(const auto op_type : binary_ops[Level]){
-			if(p.match_type(op_type)){
-				/* valid operator */
-				return { op_type, new BinExpr<Level>(p) };
-			}
+/* The index into `binary_ops` for each TokenType, or -1 if it isn't a binary operator. */
+const std::vector<int> binary_level = [](){
+	std::vector<int> res(TOKENTYPE_LENGTH, -1);
+	for(size_t level = 0; level < std::size(binary_ops); level++){
+		for(const auto op : binary_ops[level]){
+			res[static_cast<int>(op)] = level;
 		}
-		// no operator
-		return { TokenType::INVALID, nullptr };
-	}
-	
-	BinExpr(Parser& p) : left(p), opt(make_opt(p)) {}
-	/* copy */ BinExpr(BinExpr& be) = delete;
-	/* move */ BinExpr(BinExpr&& be) noexcept : left(std::move(be.left)), opt(be.opt) {
-		be.opt = { TokenType::INVALID, nullptr };
-	}
-	~BinExpr() {
-		if(opt.op != TokenType::INVALID) delete opt.right;
 	}
+	return res;
+}();
+
+inline int binaryLevel(const TokenType op) noexcept {
+	return binary_level[static_cast<int>(op)];
+}
+
+/* One node per operator or operand.
+ * It's parsed with precedence climbing,
+ * so all the binary operators are left associative
+ * (a - b - c is (a - b) - c), and parentheses don't make a node at all. */
+class Expr {
+public:
+	enum class Kind : uint8_t { PRIMARY, UNARY, BINARY };
+	Kind kind;
+	TokenType op = TokenType::INVALID; /* for UNARY and BINARY */
+	union {
+		Primary *primary; /* PRIMARY */
+		Expr *left; /* BINARY */
+	};
+	Expr *right = nullptr; /* BINARY, and the operand of a UNARY */
+	SType type; /* filled in by the TypeChecker */
+	/* BINARY, except AND and OR: the operator for exactly these operand types (see operators.hpp).
+	 * Also picked by the TypeChecker, so evaluating it doesn't look at the types. */
+	EValue (*apply)(EValue, EValue) = nullptr;
+	Expr(Parser& p) : Expr(parse(p, 0)) {}
 	EValue eval(Env& env) const;
-	EType type(Env& env) const;
+	/* An array returned by a call already has its own reference, so it's moved instead of copied. */
+	inline bool isCall() const noexcept {
+		return kind == Kind::PRIMARY && primary->primtype() == TokenType::CALL;
+	}
 	// friend operator<< {{{
-	friend std::ostream& operator<<(std::ostream& os, const BinExpr<Level>& b) noexcept {
+	friend std::ostream& operator<<(std::ostream& os, const Expr& e) noexcept {
 		os << '{';
-		os << b.left; 
-		if(b.opt.op != TokenType::INVALID){
-			os << ' ' << opToStr(b.opt.op) << ' ' << *b.opt.right;
+		switch(e.kind){
+			case Kind::PRIMARY:
+				os << *e.primary;
+				break;
+			case Kind::UNARY:
+				os << (e.op == TokenType::NOT ? "NOT" : "-") << *e.right;
+				break;
+			case Kind::BINARY:
+				os << *e.left << ' ' << opToStr(e.op) << ' ' << *e.right;
+				break;
 		}
 		os << '}';
 		return os;
 	}
 	// }}}
+private:
+	Expr(Primary *primary_) : kind(Kind::PRIMARY), primary(primary_) {}
+	Expr(TokenType op_, Expr *operand) : kind(Kind::UNARY), op(op_), left(nullptr), right(operand) {}
+	Expr(TokenType op_, Expr *left_, Expr *right_) : kind(Kind::BINARY), op(op_), left(left_), right(right_) {}
+	static Expr parse(Parser& p, int min_level);
+	static Expr unary(Parser& p);
 };
 
 inline LValue::LValue(Parser& p, int64_t id_) : id(id_) {
@@ -357,7 +291,7 @@ inline LValue::LValue(Parser& p, int64_t id_) : id(id_) {
 		// identifier { LEFT_SQ expr RIGHT_SQ }
 		// (array access)
 		// we distinguish between this and array access by letting indexes == nullptr by default
-		indexes = new std::vector<Expr>();
+		indexes = p.arena.make<ArenaVec<Expr>>(p.arena);
 		for(;;){
 			indexes->emplace_back(p);
 			p.expect_type(TokenType::RIGHT_SQ);
@@ -379,13 +313,18 @@ inline Primary::Primary(Parser& p) {
 		/* literal */
 		all.primtype = n.type;
 		all.main.lt = n.literal;
+		if(n.type == TokenType::STR_C){
+			/* the token's characters belong to the Lexer, which the Program shouldn't need */
+			all.str = p.strings.internCopy(n.literal.str);
+			all.main.lt.str = all.str;
+		}
 		return;
 	} else if(n.type == TokenType::IDENTIFIER){
 		if(p.match_type(TokenType::LEFT_PAREN)){
 			/* function call */
 			all.primtype = TokenType::CALL; // lmao
 			all.func_id = n.literal.i64; /* func_id is used to store the function's identifier */
-			all.main.args = new std::vector<Expr>();
+			all.main.args = p.arena.make<ArenaVec<Expr>>(p.arena);
 			if(p.match_type(TokenType::RIGHT_PAREN)){
 				return;
 			}
@@ -405,29 +344,36 @@ inline Primary::Primary(Parser& p) {
 			all.main.lvalue = std::move(lv);
 			return;
 		}
-	} else if(n.type == TokenType::LEFT_PAREN){
-		all.primtype = TokenType::INVALID;
-		all.main.expr = new Expr(p);
-		p.expect_type(TokenType::RIGHT_PAREN);
-		return;
 	} else {
 		p.error("Invalid primary");
 	}
 }
 
-inline Primary::~Primary() {
-	/* If it's a const type we don't have to do anything */
-	if(!isAnyOf(all.primtype, const_types)){
-		if(all.primtype == TokenType::CALL){
-			// Deallocate the argument array.
-			delete all.main.args;
-		} else if(all.primtype == TokenType::IDENTIFIER){
-			// delete the lvalue
-			all.main.lvalue.~LValue();
-		} else { /* TokenType::INVALID */
-			delete all.main.expr;
+/* Parses a whole expression where every operator binds at least as tightly as `min_level`. */
+inline Expr Expr::parse(Parser& p, int min_level){
+	Expr res = unary(p);
+	for(;;){
+		const int level = binaryLevel(p.peek().type);
+		if(level < min_level) return res;
+		const TokenType op = p.next().type;
+		// Only tighter operators go on the right, which makes this left associative.
+		Expr right = parse(p, level + 1);
+		res = Expr(op, p.arena.make<Expr>(res), p.arena.make<Expr>(right));
+	}
+}
+
+inline Expr Expr::unary(Parser& p){
+	for(const auto op : unary_ops){
+		if(p.match_type(op)){
+			return Expr(op, p.arena.make<Expr>(unary(p)));
 		}
 	}
+	if(p.match_type(TokenType::LEFT_PAREN)){
+		Expr res = parse(p, 0);
+		p.expect_type(TokenType::RIGHT_PAREN);
+		return res;
+	}
+	return Expr(p.arena.make<Primary>(p));
 }
 
 class Type {
@@ -452,12 +398,12 @@ public:
 		if(p.match_type(TokenType::ARRAY)){
 			res.is_array = true;
 			p.expect_type(TokenType::LEFT_SQ);
-			res.start = new Expr(p);
+			res.start = p.arena.make<Expr>(p);
 			p.expect_type(TokenType::COLON);
-			res.end = new Expr(p);
+			res.end = p.arena.make<Expr>(p);
 			p.expect_type(TokenType::RIGHT_SQ);
 			p.expect_type(TokenType::OF);
-			res.name.rec = new Type(p);
+			res.name.rec = p.arena.make<Type>(p);
 			return res;
 		} else {
 			res.is_array = false;
@@ -471,11 +417,6 @@ public:
 		}
 	}
 	Type(Parser& p): all(make_all(p)) {}
-	~Type() {
-		if(all.is_array) {
-			delete all.name.rec;
-		}
-	}
 	EType to_etype(Env& env, bool is_top = true) const;
 	// friend operator<< {{{
 	friend std::ostream& operator<<(std::ostream& os, const Type& type){
@@ -581,9 +522,9 @@ inline bool isValidStmtStart(const TokenType type) noexcept {
 
 class Block {
 public:
-	std::vector<Stmt<false>> stmts;
+	ArenaVec<Stmt<false>> stmts;
 	bool is_func;
-	Block(Parser& p, bool is_func_ = false) : is_func(is_func_) {
+	Block(Parser& p, bool is_func_ = false) : stmts(p.arena), is_func(is_func_) {
 		while(isValidStmtStart(p.peek().type) || (is_func && p.peek().type == TokenType::RETURN)){
 			stmts.emplace_back(p, is_func);
 		}
@@ -603,8 +544,16 @@ public:
 
 class Program {
 public:
-	std::vector<Stmt<true>> stmts;
-	Program(Parser& p){
+	ArenaVec<Stmt<true>> stmts;
+	// Filled in by the TypeChecker.
+	uint32_t global_count = 0;
+	uint32_t frame_size = 0; /* for the FOR variables at the top level */
+	/* Every function that can be called, by number.
+	 * The builtins are already here; a PROCEDURE or FUNCTION is nullptr
+	 * until its definition runs (see Env::functable). */
+	ArenaVec<const EFunc *> functions;
+	const StringStore *strings; /* what the STRING literals point into */
+	Program(Parser& p) : stmts(p.arena), functions(p.arena), strings(&p.strings) {
 		while(!p.done()){
 			stmts.emplace_back(p);
 		}
@@ -626,12 +575,17 @@ template<bool TopLevel>
 class Stmt {
 public:
 	StmtForm form;
-	std::vector<int64_t> ids;
-	std::vector<LValue> lvalues;
-	std::vector<Expr> exprs;
-	std::vector<Type> types;
-	std::vector<Param> params;
-	std::vector<Block> blocks;
+	uint32_t line; /* of its first token, for --profile */
+	ArenaVec<int64_t> ids;
+	ArenaVec<LValue> lvalues;
+	ArenaVec<Expr> exprs;
+	ArenaVec<Type> types;
+	ArenaVec<Param> params;
+	ArenaVec<Block> blocks;
+	// Filled in by the TypeChecker.
+	uint32_t slot = 0; /* the variable of a DECLARE, CONSTANT or FOR */
+	uint32_t frame_size = 0; /* for a PROCEDURE or FUNCTION */
+	uint32_t func = 0; /* the function a CALL calls, or a PROCEDURE or FUNCTION defines */
 	void paramlist(Parser& p){
 		size_t param_count = 0;
 		for(;;){
@@ -786,7 +740,10 @@ public:
 	}
 #undef CASE
 #undef CONSUME_ID
-	Stmt(Parser& p, bool is_func = false){
+	Stmt(Parser& p, bool is_func = false) :
+		ids(p.arena), lvalues(p.arena), exprs(p.arena), types(p.arena), params(p.arena), blocks(p.arena)
+	{
+		line = p.peek().line;
 		if constexpr (TopLevel){
 			topstmt(p);
 		} else {
@@ -826,21 +783,17 @@ public:
 
 // }}}
 
-// Parser::{parse, run, ~Parser} {{{
+// Parser::{parse, run} {{{
 
 inline void Parser::parse(){
-	output = new Program(*this);
+	output = arena.make<Program>(*this);
 }
 
  
-inline void Parser::run(Env& env){
+inline void Parser::run(Env& env) const {
 	output->eval(env);
 }
 
-inline Parser::~Parser() {
-	delete output;
-}
-
 // }}}
 
 #endif /* PARSER_HPP */
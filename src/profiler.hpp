@@ -0,0 +1,88 @@
+#ifndef PROFILER_HPP
+#define PROFILER_HPP
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <ostream>
+#include <string_view>
+#include <vector>
+
+/* For --profile: how many times each line ran, and how long was spent on it.
+ * Whichever engine is running calls line() as each statement starts,
+ * and all the time until the next call goes to that statement's line.
+ * (So a line's time doesn't include the functions it calls, those have lines of their own.) */
+class Profiler {
+	using clock = std::chrono::steady_clock;
+	struct Line {
+		uint64_t count = 0;
+		clock::duration time = clock::duration::zero();
+	};
+	std::vector<Line> lines; /* indexed by line number, 0 is before the first statement */
+	size_t curr = 0;
+	clock::time_point last = clock::now();
+public:
+	/* Line `n` starts running, or carries on (without counting as another run) after a call returns. */
+	inline void line(size_t n, bool count = true){
+		const clock::time_point now = clock::now();
+		if(n >= lines.size()) lines.resize(n + 1);
+		lines[curr].time += now - last;
+		last = now;
+		curr = n;
+		if(count) lines[n].count++;
+	}
+	inline size_t current() const noexcept {
+		return curr;
+	}
+	/* How many times line `n` ran. */
+	inline uint64_t count(size_t n) const noexcept {
+		return n < lines.size() ? lines[n].count : 0;
+	}
+	/* The program's done, so the time stops counting. */
+	inline void stop(){
+		line(0, false);
+	}
+
+	/* The hottest lines first, and then the whole source with each line's numbers next to it. */
+	void report(std::ostream& os, std::string_view src) const {
+		std::vector<std::string_view> text = { "" }; // so text[n] is line n
+		for(size_t start = 0; start < src.size();){
+			size_t end = src.find('\n', start);
+			if(end == std::string_view::npos) end = src.size();
+			std::string_view l = src.substr(start, end - start);
+			if(!l.empty() && l.back() == '\r') l.remove_suffix(1);
+			text.push_back(l);
+			start = end + 1;
+		}
+		const auto ms = [](clock::duration d){ return std::chrono::duration<double, std::milli>(d).count(); };
+		clock::duration total = clock::duration::zero();
+		for(size_t n = 1; n < lines.size(); n++) total += lines[n].time;
+		const double total_ms = std::max(ms(total), 1e-9);
+
+		char buf[96];
+		const auto row = [&](size_t n, const Line& l){
+			snprintf(buf, sizeof(buf), "%6zu %12llu %12.3f %6.1f%% | ",
+				n, (unsigned long long)l.count, ms(l.time), 100 * ms(l.time) / total_ms);
+			os << buf << (n < text.size() ? text[n] : "") << '\n';
+		};
+		const char *header = "  line        count    time (ms)      %\n";
+
+		std::vector<size_t> hot;
+		for(size_t n = 1; n < lines.size(); n++){
+			if(lines[n].count != 0) hot.push_back(n);
+		}
+		std::stable_sort(hot.begin(), hot.end(), [&](size_t a, size_t b){ return lines[a].time > lines[b].time; });
+		snprintf(buf, sizeof(buf), "%.3f", ms(total));
+		os << "Profile: " << buf << "ms in statements\n\nLines by time:\n" << header;
+		for(const size_t n : hot){
+			row(n, lines[n]);
+		}
+		os << "\nSource:\n" << header;
+		const Line none;
+		for(size_t n = 1; n < text.size(); n++){
+			row(n, n < lines.size() ? lines[n] : none);
+		}
+	}
+};
+
+#endif /* PROFILER_HPP */
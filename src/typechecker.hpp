@@ -0,0 +1,536 @@
+#ifndef TYPECHECKER_HPP
+#define TYPECHECKER_HPP
+
+#include <map>
+#include <vector>
+#include <string>
+#include "parser.hpp"
+#include "operators.hpp"
+
+/* Works out the type of every expression once, before anything runs,
+ * and writes it into the `type` field of each Expr, Primary and LValue.
+ * It also resolves every variable to a Slot,
+ * so at runtime a variable is just an index into the globals or the current call frame.
+ * All the TypeErrors (and the errors that don't depend on values,
+ * like calling something that isn't a function) are reported here,
+ * so neither the tree-walker nor the compiler have to check again.
+ *
+ * Scoping follows what the tree-walker does:
+ * a function can see the globals and its own parameters and FOR variables,
+ * and the top level can see the globals it has DECLAREd so far and its own FOR variables.
+ *
+ * A BYREF parameter has to be given a variable or an array element (of exactly its type),
+ * and its Slot is a REF, since it holds a pointer to that instead of a value.
+ *
+ * Every function gets a number, which is where it is in Program::functions
+ * (the PROCEDUREs and FUNCTIONs first, then the builtins),
+ * so calling one at runtime doesn't have to look up its identifier.
+ *
+ * The Compiler reads the types of the globals and the functions' signatures from here,
+ * instead of working them out again.
+ */
+
+// TypeChecker {{{
+
+class TypeChecker {
+public:
+	struct Function {
+		size_t stmt;
+		Stmt<true> *def;
+		bool is_func;
+		std::vector<SType> params;
+		std::vector<bool> byref;
+		SType ret;
+		uint32_t index; /* in Program::functions */
+	};
+	inline TypeChecker(Program& program, const std::map<std::string_view, int64_t>& id_map);
+	/* The PROCEDUREs and FUNCTIONs by number, which are the start of Program::functions.
+	 * The builtins come after them. */
+	inline const std::vector<const Function *>& definitions() const noexcept {
+		return numbered;
+	}
+	/* The type of the global in `slot` (the same for the whole program, since it can only be DECLAREd once). */
+	inline const SType& global(uint32_t slot) const {
+		return global_types[slot];
+	}
+private:
+	struct Global {
+		uint32_t index;
+		size_t stmt; /* index of the statement that declares it */
+		bool declared = false;
+	};
+	struct Builtin {
+		uint32_t index;
+		const EFunc *func;
+	};
+	struct Local {
+		int64_t id;
+		SType type;
+		bool byref = false;
+	};
+
+	std::map<int64_t, Global> globals;
+	std::vector<SType> global_types; /* by slot, INVALID until it's declared */
+	std::map<int64_t, Function> functions;
+	std::vector<const Function *> numbered; /* the same functions, by number */
+	std::map<int64_t, Builtin> builtins;
+
+	// State for the function being checked.
+	const Function *curr_func = nullptr; /* nullptr for the top level */
+	std::vector<Local> locals; /* the index is the slot */
+	uint32_t frame_size = 0;
+
+	// Helpers {{{
+	/* These give the same messages as expectTypeEqual() in interpreter.hpp. */
+	static void expectType(const SType& t1, const SType& t2){
+		if(t1 != t2){
+			throw TypeError("Bad type " + t1.to_str() + ", expected " + t2.to_str());
+		}
+	}
+	static void expectType(const SType& t1, Primitive a, Primitive b){
+		if(t1 != a && t1 != b){
+			throw TypeError("Bad type " + t1.to_str() + ", expected any of: "
+					+ std::string(primitiveToStr(a)) + ", " + std::string(primitiveToStr(b)));
+		}
+	}
+	static bool isNumeric(const SType& t) noexcept {
+		return t == Primitive::INTEGER || t == Primitive::REAL;
+	}
+	// }}}
+
+	inline SType typeOf(const Type& type) const;
+	inline void bounds(Type& type);
+	inline SType lookup(int64_t id, Slot& slot) const;
+	inline uint32_t addLocal(int64_t id, SType type, bool byref = false);
+
+	// Expressions {{{
+	inline SType expr(Expr& e);
+	inline SType expr(Primary& p);
+	inline SType lvalue(LValue& lv);
+	inline SType call(int64_t id, ArenaVec<Expr>& args, bool need_value, uint32_t& index);
+	static inline SType binop(TokenType op, SType l, SType r);
+	// }}}
+
+	// Statements {{{
+	inline void block(Block& b);
+	template<bool TopLevel>
+	inline void stmt(Stmt<TopLevel>& s, size_t index);
+	inline void function(const Function& func);
+	// }}}
+};
+
+// }}}
+
+// TypeChecker::{typeOf, bounds, lookup} {{{
+
+inline SType TypeChecker::typeOf(const Type& type) const {
+	if(type.is_array()){
+		SType res = typeOf(*type.name().rec);
+		res.rank++;
+		return res;
+	}
+	switch(type.name().tok){
+#define CASE(x) case TokenType:: x: return Primitive:: x;
+		CASE(INTEGER);
+		CASE(STRING);
+		CASE(REAL);
+		CASE(CHAR);
+		CASE(BOOLEAN);
+		CASE(DATE);
+		default: throw RuntimeError("Invalid type primitive. (INTERNAL ERROR)");
+#undef CASE
+	}
+}
+
+/* Array bounds are evaluated wherever the type is written down. */
+inline void TypeChecker::bounds(Type& type){
+	for(Type *curr = &type; curr->is_array(); curr = curr->name().rec){
+		if(expr(*curr->all.start) != Primitive::INTEGER || expr(*curr->all.end) != Primitive::INTEGER){
+			throw RuntimeError("The start and end types must be INTEGERs");
+		}
+	}
+}
+
+inline SType TypeChecker::lookup(int64_t id, Slot& slot) const {
+	for(size_t i = locals.size(); i-- > 0;){
+		if(locals[i].id == id){
+			slot = { locals[i].byref ? Slot::Frame::REF : Slot::Frame::LOCAL, static_cast<uint32_t>(i) };
+			return locals[i].type;
+		}
+	}
+	const auto it = globals.find(id);
+	if(it != globals.end()){
+		const Global& g = it->second;
+		const SType& type = global_types[g.index];
+		if(curr_func == nullptr){
+			if(g.declared){
+				slot = { Slot::Frame::GLOBAL, g.index };
+				return type;
+			}
+		} else if(type.primtype != Primitive::INVALID){
+			// Functions are checked after the top level,
+			// so they can see globals that are DECLAREd after them.
+			// A global DECLAREd before the function is guaranteed to exist when it runs,
+			// the others have to be checked at runtime.
+			slot = { g.stmt < curr_func->stmt ? Slot::Frame::GLOBAL : Slot::Frame::GLOBAL_CHECKED, g.index };
+			return type;
+		}
+	}
+	throw RuntimeError("Undefined variable");
+}
+
+/* Returns the new variable's slot. */
+inline uint32_t TypeChecker::addLocal(int64_t id, SType type, bool byref){
+	locals.push_back({ id, type, byref });
+	frame_size = std::max<uint32_t>(frame_size, locals.size());
+	return locals.size() - 1;
+}
+
+// }}}
+
+// TypeChecker::{expr, lvalue, call, binop} {{{
+
+inline SType TypeChecker::expr(Expr& e){
+	switch(e.kind){
+		case Expr::Kind::PRIMARY:
+			return e.type = expr(*e.primary);
+		case Expr::Kind::UNARY:
+			{
+				const SType val = expr(*e.right);
+				if(e.op == TokenType::NOT){
+					expectType(val, Primitive::BOOLEAN);
+				} else if(e.op == TokenType::MINUS){
+					expectType(val, Primitive::INTEGER, Primitive::REAL);
+				} else {
+					throw RuntimeError("Invalid unary expr operator. This should not have happened!");
+				}
+				return e.type = val;
+			}
+		case Expr::Kind::BINARY:
+			{
+				const SType l = expr(*e.left);
+				const SType r = expr(*e.right);
+				e.type = binop(e.op, l, r);
+				if(e.op != TokenType::AND && e.op != TokenType::OR){
+					e.apply = ops::binary(e.op, l.primtype, r.primtype);
+				}
+				return e.type;
+			}
+	}
+	throw RuntimeError("Invalid expr kind. (INTERNAL ERROR)");
+}
+
+inline SType TypeChecker::binop(TokenType op, SType l, SType r){
+	const int level = binaryLevel(op);
+	if(level <= 1) {
+		expectType(l, Primitive::BOOLEAN);
+		expectType(r, Primitive::BOOLEAN);
+		return Primitive::BOOLEAN;
+	} else if(level == 2) {
+		// INTEGERs get converted to REALs to compare with REALs.
+		if(isNumeric(l) && isNumeric(r)) return Primitive::BOOLEAN;
+		if(l != r) throw TypeError("Cannot compare two different types");
+		if(l.is_array()) throw TypeError("Cannot compare arrays");
+		return Primitive::BOOLEAN;
+	} else if(level == 3) {
+		if(!isNumeric(l) || !isNumeric(r)){
+			throw TypeError("Invalid type applied to math expression");
+		}
+		// REAL op INTEGER => REAL
+		return (l == Primitive::INTEGER && r == Primitive::INTEGER) ? Primitive::INTEGER : Primitive::REAL;
+	} else {
+		// All of these operators only work on INTEGERs or REALs.
+		expectType(l, Primitive::REAL, Primitive::INTEGER);
+		expectType(r, Primitive::REAL, Primitive::INTEGER);
+		switch(op){
+			case TokenType::STAR:
+				return (l == Primitive::INTEGER && r == Primitive::INTEGER) ? Primitive::INTEGER : Primitive::REAL;
+			case TokenType::SLASH:
+				return Primitive::REAL;
+			case TokenType::MOD:
+			case TokenType::DIV:
+				// MOD, DIV both only take integers
+				expectType(l, Primitive::INTEGER);
+				expectType(r, Primitive::INTEGER);
+				return Primitive::INTEGER;
+			default:
+				throw RuntimeError("Invalid operator for *,/,MOD,DIV expr. (INTERNAL ERROR)");
+		}
+	}
+}
+
+inline SType TypeChecker::expr(Primary& p){
+	switch(p.primtype()){
+#define LITERAL(x, prim) case TokenType:: x: return p.type = Primitive:: prim;
+		LITERAL(REAL_C, REAL);
+		LITERAL(INT_C, INTEGER);
+		LITERAL(CHAR_C, CHAR);
+		LITERAL(TRUE, BOOLEAN);
+		LITERAL(FALSE, BOOLEAN);
+		LITERAL(DATE_C, DATE);
+		LITERAL(STR_C, STRING);
+#undef LITERAL
+		case TokenType::IDENTIFIER:
+			return p.type = lvalue(p.all.main.lvalue);
+		case TokenType::CALL:
+			return p.type = call(p.all.func_id, *p.all.main.args, true, p.all.func);
+		default:
+			throw RuntimeError("Invalid primary type. (INTERNAL ERROR)");
+	}
+}
+
+inline SType TypeChecker::lvalue(LValue& lv){
+	const SType type = lookup(lv.id, lv.slot);
+	if(lv.indexes == nullptr) return lv.type = type;
+	if(!type.is_array() || lv.indexes->size() != type.rank){
+		throw TypeError("Cannot index a non-array");
+	}
+	for(Expr& index : *lv.indexes){
+		expectType(expr(index), Primitive::INTEGER);
+	}
+	return lv.type = type.primtype;
+}
+
+inline SType TypeChecker::call(int64_t id, ArenaVec<Expr>& args, bool need_value, uint32_t& index){
+	const auto func_it = functions.find(id);
+	const auto builtin_it = builtins.find(id);
+	if(func_it != functions.end()){
+		const Function& func = func_it->second;
+		if(need_value && !func.is_func){
+			throw RuntimeError("Cannot call procedure and use it as a value");
+		}
+		if(args.size() != func.params.size()){
+			throw RuntimeError("Invalid number of parameters for function");
+		}
+		for(size_t i = 0; i < args.size(); i++){
+			if(func.byref[i] && !(args[i].kind == Expr::Kind::PRIMARY && args[i].primary->primtype() == TokenType::IDENTIFIER)){
+				throw RuntimeError("Cannot pass an expression BYREF");
+			}
+			expectType(expr(args[i]), func.params[i]);
+		}
+		index = func.index;
+		return func.ret;
+	} else if(builtin_it != builtins.end()){
+		const EFunc& func = *builtin_it->second.func;
+		if(args.size() != func.arity){
+			throw RuntimeError("Invalid number of parameters for function");
+		}
+		for(size_t i = 0; i < args.size(); i++){
+			const SType type = expr(args[i]);
+			if(type.is_array() || type.primtype != func.types[i].primtype){
+				throw TypeError("Bad type " + type.to_str() + ", expected " + func.types[i].to_str());
+			}
+		}
+		index = builtin_it->second.index;
+		return func.ret_type.primtype;
+	} else {
+		throw RuntimeError("Cannot call non-function");
+	}
+}
+
+// }}}
+
+// TypeChecker::{block, stmt, function} {{{
+
+inline void TypeChecker::block(Block& b){
+	for(auto& s : b.stmts){
+		if(s.form == StmtForm::RETURN){
+			// make sure the return type and the expr are equal
+			expectType(expr(s.exprs[0]), curr_func->ret);
+			// Anything after this can't run.
+			return;
+		}
+		stmt(s, 0);
+	}
+}
+
+template<bool TopLevel>
+inline void TypeChecker::stmt(Stmt<TopLevel>& s, size_t index){
+#define CASE(x) case StmtForm:: x
+	if constexpr (TopLevel) {
+		switch(s.form){
+			CASE(DECLARE):
+			CASE(CONSTANT):
+				{
+					Global& g = globals.at(s.ids[0]);
+					if(g.declared || g.stmt != index){
+						throw RuntimeError("Cannot initialize already-initialized variable");
+					}
+					s.slot = g.index;
+					SType& type = global_types[g.index];
+					if(s.form == StmtForm::DECLARE){
+						bounds(s.types[0]);
+						type = typeOf(s.types[0]);
+					} else {
+						type = expr(s.exprs[0]);
+						if(type.is_array()){
+							throw TypeError("Cannot declare an array CONSTANT");
+						}
+					}
+					g.declared = true;
+				}
+				return;
+			CASE(PROCEDURE):
+			CASE(FUNCTION):
+				{
+					const Function& func = functions.at(s.ids[0]);
+					if(func.def != &s){
+						throw RuntimeError("Cannot redefine function");
+					}
+					s.func = func.index;
+					// The parameter and return types are evaluated when the definition runs.
+					for(Param& param : s.params){
+						bounds(param.type);
+					}
+					if(func.is_func) bounds(s.types[0]);
+				}
+				return;
+			default:
+				break;
+		}
+	}
+	switch(s.form){
+		CASE(ASSIGN):
+			{
+				const SType type = lvalue(s.lvalues[0]);
+				const SType exprtype = expr(s.exprs[0]);
+				if(!(type == Primitive::REAL && exprtype == Primitive::INTEGER)){
+					expectType(exprtype, type);
+				}
+			}
+			break;
+		CASE(INPUT):
+			if(lvalue(s.lvalues[0]).is_array()){
+				throw TypeError("Cannot input array");
+			}
+			break;
+		CASE(OUTPUT):
+			for(Expr& e : s.exprs){
+				if(expr(e).is_array()) throw TypeError("Cannot output array");
+			}
+			break;
+		CASE(IF):
+			expectType(expr(s.exprs[0]), Primitive::BOOLEAN);
+			for(Block& b : s.blocks) block(b);
+			break;
+		CASE(CASE):
+			{
+				const SType type = lvalue(s.lvalues[0]);
+				if(type.is_array()){
+					throw TypeError("Cannot use array in CASE OF");
+				}
+				for(size_t i = 0; i < s.exprs.size(); i++){
+					const SType exprtype = expr(s.exprs[i]);
+					if(exprtype.is_array()){
+						throw TypeError("Cannot use array in CASE OF case");
+					}
+					if(isAnyOf(Primitive::REAL, type.primtype, exprtype.primtype) && type != exprtype){
+						// INTEGER, REAL or vice versa
+						if(!isNumeric(type) || !isNumeric(exprtype)){
+							throw TypeError("Cannot convert condition to REAL");
+						}
+					} else {
+						expectType(exprtype, type);
+					}
+					block(s.blocks[i]);
+				}
+				if(s.blocks.size() > s.exprs.size()){
+					// the last block is an OTHERWISE
+					block(s.blocks.back());
+				}
+			}
+			break;
+		CASE(FOR):
+			{
+				bool is_frac = false;
+				for(Expr& e : s.exprs){
+					const SType type = expr(e);
+					expectType(type, Primitive::REAL, Primitive::INTEGER);
+					is_frac |= (type == Primitive::REAL);
+				}
+				// The loop variable is in scope only inside the loop.
+				s.slot = addLocal(s.ids[0], is_frac ? Primitive::REAL : Primitive::INTEGER);
+				block(s.blocks[0]);
+				locals.pop_back();
+			}
+			break;
+		CASE(REPEAT):
+			block(s.blocks[0]);
+			expectType(expr(s.exprs[0]), Primitive::BOOLEAN);
+			break;
+		CASE(WHILE):
+			expectType(expr(s.exprs[0]), Primitive::BOOLEAN);
+			block(s.blocks[0]);
+			break;
+		CASE(CALL):
+			call(s.ids[0], s.exprs, false, s.func);
+			break;
+		default:
+			// RETURN is handled in block().
+			throw RuntimeError("Invalid start of statement. (INTERNAL ERROR)");
+	}
+#undef CASE
+}
+
+inline void TypeChecker::function(const Function& func){
+	Stmt<true>& s = *func.def;
+	curr_func = &func;
+	locals.clear();
+	frame_size = 0;
+	// The arguments are the first slots of the frame.
+	for(size_t i = 0; i < s.params.size(); i++){
+		addLocal(s.params[i].ident, func.params[i], func.byref[i]);
+	}
+	block(s.blocks[0]);
+	s.frame_size = frame_size;
+	curr_func = nullptr;
+}
+
+// }}}
+
+// TypeChecker::TypeChecker {{{
+
+inline TypeChecker::TypeChecker(Program& program, const std::map<std::string_view, int64_t>& id_map){
+	// Find everything that's global first,
+	// since functions can use things that are defined after them.
+	for(size_t i = 0; i < program.stmts.size(); i++){
+		Stmt<true>& s = program.stmts[i];
+		if(s.form == StmtForm::DECLARE || s.form == StmtForm::CONSTANT){
+			if(globals.find(s.ids[0]) == globals.end()){
+				globals.insert({ s.ids[0], { program.global_count++, i, false } });
+			}
+		} else if(s.form == StmtForm::PROCEDURE || s.form == StmtForm::FUNCTION){
+			if(functions.find(s.ids[0]) != functions.end()) continue;
+			Function func = { i, &s, s.form == StmtForm::FUNCTION, {}, {}, {}, (uint32_t)program.functions.size() };
+			program.functions.push_back(nullptr);
+			for(const Param& param : s.params){
+				func.params.push_back(typeOf(param.type));
+				func.byref.push_back(param.byref);
+			}
+			if(func.is_func) func.ret = typeOf(s.types[0]);
+			numbered.push_back(&functions.insert({ s.ids[0], func }).first->second);
+		}
+	}
+	global_types.assign(program.global_count, SType());
+	// User-defined functions take priority over builtins.
+	for(const auto& func : builtin::global_funcs){
+		auto it = id_map.find(func.first);
+		if(it != id_map.end() && functions.find(it->second) == functions.end()){
+			builtins.insert({ it->second, { (uint32_t)program.functions.size(), &func.second } });
+			program.functions.push_back(&func.second);
+		}
+	}
+	// The top level.
+	for(size_t i = 0; i < program.stmts.size(); i++){
+		stmt(program.stmts[i], i);
+	}
+	program.frame_size = frame_size;
+	// The functions.
+	for(const auto& func : functions){
+		function(func.second);
+	}
+}
+
+// }}}
+
+#endif /* TYPECHECKER_HPP */
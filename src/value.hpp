@@ -2,6 +2,12 @@
 #define VALUE_HPP
 
 #include <vector>
+#include <string>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <algorithm>
+#include <type_traits>
 #include "fraction.hpp"
 #include "date.hpp"
 
@@ -27,11 +33,29 @@ struct EType {
 	bool is_array;
 	std::vector<std::pair<int64_t,int64_t>> bounds; /* array [start, end], where length is level of nesting */
 	Primitive primtype;
-	EType() : primtype(Primitive::INVALID) {}
+	EType() : is_array(false), primtype(Primitive::INVALID) {}
 	EType(Primitive primtype_):  is_array(false), primtype(primtype_) {}
 	EType(bool is_arr, std::vector<std::pair<int64_t,int64_t>> bounds_, Primitive primtype_):
 		is_array(is_arr), bounds(bounds_), primtype(primtype_) {}
 	inline bool is_primitive() const noexcept { return is_array == false; }
+	/* How many elements an array of this type has. */
+	inline size_t size() const noexcept {
+		size_t res = 1;
+		for(const auto& b : bounds){
+			res *= b.second - b.first + 1;
+		}
+		return res;
+	}
+	/* Same, but false if it doesn't fit in a size_t (the bounds have to be the right way round). */
+	inline bool size(size_t& res) const noexcept {
+		res = 1;
+		for(const auto& b : bounds){
+			// can't overflow, since end >= start
+			const uint64_t span = static_cast<uint64_t>(b.second) - static_cast<uint64_t>(b.first);
+			if(span >= SIZE_MAX || __builtin_mul_overflow(res, static_cast<size_t>(span + 1), &res)) return false;
+		}
+		return true;
+	}
 	inline bool operator==(const EType& et) const noexcept {
 		bool res = 
 			primtype == et.primtype && 
@@ -84,22 +108,279 @@ inline bool operator==(const Primitive prim, const EType& e) noexcept {
 	return e == prim;
 }
 
+const uint32_t NO_DESC = UINT32_MAX;
+
+/* The type of a value as far as it can be known before running.
+ * Array bounds are only known at runtime, so only the rank is kept.
+ * The compiler also records which array descriptor the bounds will be in. */
+struct SType {
+	Primitive primtype = Primitive::INVALID;
+	uint32_t rank = 0;
+	uint32_t desc = NO_DESC;
+	SType() {}
+	SType(Primitive primtype_): primtype(primtype_) {}
+	SType(Primitive primtype_, uint32_t rank_, uint32_t desc_): primtype(primtype_), rank(rank_), desc(desc_) {}
+	inline bool is_array() const noexcept { return rank > 0; }
+	inline bool operator==(const SType& st) const noexcept {
+		return primtype == st.primtype && rank == st.rank;
+	}
+	inline bool operator!=(const SType& st) const noexcept {
+		return !operator==(st);
+	}
+	inline std::string to_str() const {
+		std::string res;
+		for(uint32_t i = 0; i < rank; i++){
+			res += "ARRAY OF ";
+		}
+		res += primitiveToStr(primtype);
+		return res;
+	}
+};
+
+/* Where a variable lives. Worked out by the TypeChecker. */
+struct Slot {
+	enum class Frame : uint8_t {
+		LOCAL, /* in the current call frame (parameters and FOR variables) */
+		GLOBAL,
+		GLOBAL_CHECKED, /* a global that might not have been DECLAREd yet when this runs */
+		REF /* a BYREF parameter: the slot in the current frame points to the variable */
+	} frame = Frame::LOCAL;
+	uint32_t index = 0;
+};
+
+struct EArray;
+
+/* A STRING. It only points to a string_view that doesn't move (one interned by a StringStore),
+ * so it's 8 bytes instead of 16 and copying it doesn't copy any characters.
+ * Equal strings are interned to the same view, so equality only compares the pointers;
+ * ordering still has to compare the characters. */
+struct EString {
+	const std::string_view *view;
+	inline operator std::string_view() const noexcept { return *view; }
+};
+
+inline bool operator==(const EString a, const EString b) noexcept { return a.view == b.view; }
+inline bool operator!=(const EString a, const EString b) noexcept { return a.view != b.view; }
+inline bool operator<(const EString a, const EString b) noexcept { return *a.view < *b.view; }
+inline bool operator<=(const EString a, const EString b) noexcept { return *a.view <= *b.view; }
+inline bool operator>(const EString a, const EString b) noexcept { return *a.view > *b.view; }
+inline bool operator>=(const EString a, const EString b) noexcept { return *a.view >= *b.view; }
+
+/* What an unassigned STRING points to. */
+inline constexpr std::string_view empty_string;
+
+/* One variable, array element or register.
+ * It doesn't know its own type, since the TypeChecker already worked out every type,
+ * which is also why the largest member can be 8 bytes. */
 union EValue {
-	std::string_view str;
+	EString str;
 	int64_t i64;
 	Fraction<> frac;
 	char c;
 	bool b;
 	Date date;
-	std::vector<EValue> *vals;
-	inline EValue(){}
-	inline EValue(const std::string_view str_): str(str_) {}
+	EArray *arr;
+	EValue *ref; /* what a BYREF parameter refers to */
+	/* Trivial, so the stacks can be allocated without touching them.
+	 * `EValue()` is still all zeroes. */
+	EValue() = default;
+	inline EValue(const EString str_): str(str_) {}
 	inline EValue(const int64_t i64_): i64(i64_) {}
 	inline EValue(const Fraction<> frac_): frac(frac_) {}
 	inline EValue(const char c_): c(c_) {}
 	inline EValue(const bool b_): b(b_) {}
 	inline EValue(const Date date_): date(date_) {}
-	inline EValue(std::vector<EValue> * const val_): vals(val_) {}
+	inline EValue(EArray * const arr_): arr(arr_) {}
+};
+static_assert(sizeof(EValue) == 8, "EValue should be 8 bytes");
+static_assert(std::is_trivially_default_constructible_v<EValue>, "EValue shouldn't need initializing");
+
+/* What a freshly DECLAREd variable holds. */
+inline EValue defaultValue(const Primitive primtype){
+	switch(primtype){
+		case Primitive::REAL: return Fraction<>(0);
+		case Primitive::STRING: return EString{ &empty_string };
+		default: return (int64_t)0;
+	}
+}
+
+/* The elements of an array, in row-major order.
+ * Copying an array just shares this, and whoever writes to it first
+ * gets their own copy (see Env::setElement()),
+ * so arrays still behave like they're copied by value.
+ *
+ * BOOLEANs are packed 8 to a byte, and CHARs take a byte each, instead of a whole EValue.
+ * Nothing can point into packed elements though,
+ * so passing one BYREF unpacks the array for good (see Env::refElement()).
+ *
+ * Big arrays are split into pages, which are only allocated when something's written to them,
+ * so declaring one doesn't cost anything until it's used.
+ * Until then, a page reads as `fill`.
+ *
+ * While an element is passed BYREF, the array is pinned:
+ * its elements can't move to a new copy, so copying it copies straight away instead of sharing.
+ *
+ * The Env that made it keeps track of it, and deletes it once nothing refers to it or pins it
+ * (see Env::release()), or when the Env itself goes away. */
+struct EArray {
+	enum class Packing : uint8_t {
+		NONE, /* an EValue each */
+		BITS, /* BOOLEAN */
+		BYTES /* CHAR */
+	};
+	static constexpr size_t PAGE_BYTES = 4096;
+	static constexpr size_t PAGED_FROM = 1 << 20; /* smaller arrays are allocated all at once */
+	/* The most elements an array can have, so that its size in bytes fits in a size_t.
+	 * Env::allocArr() checks this before anything below is worked out. */
+	static constexpr size_t MAX_LENGTH = SIZE_MAX / sizeof(EValue);
+	uint32_t refs = 1; /* how many variables share it */
+	uint32_t pins = 0; /* how many BYREF parameters point into it */
+	Packing packing;
+	bool paged;
+	uint8_t shift; /* a page has 1 << shift elements */
+	size_t length;
+	size_t page_count = 0; /* how many pages have been allocated */
+	EValue fill; /* what every element starts out as */
+	std::vector<uint8_t> dense; /* if it isn't paged */
+	std::vector<std::unique_ptr<uint8_t[]>> pages; /* if it is (nullptr until it's written to) */
+	EArray *prev = nullptr, *next = nullptr; /* in the Env's list of live arrays */
+
+	EArray(size_t size, const Primitive primtype): EArray(size, packingOf(primtype), defaultValue(primtype)) {}
+	EArray(size_t size, const Packing packing_, const EValue fill_):
+		packing(packing_), paged(storageSize(packing_, size) > PAGED_FROM),
+		shift(pageShift(packing_)), length(size), fill(fill_)
+	{
+		if(paged){
+			pages.resize(((size - 1) >> shift) + 1);
+		} else {
+			dense.resize(storageSize(packing, size));
+			fillIn(dense.data(), size);
+		}
+	}
+	EArray(const EArray& a):
+		packing(a.packing), paged(a.paged), shift(a.shift), length(a.length),
+		page_count(a.page_count), fill(a.fill), dense(a.dense), pages(a.pages.size())
+	{
+		for(size_t p = 0; p < pages.size(); p++){
+			if(a.pages[p] == nullptr) continue;
+			pages[p].reset(new uint8_t[PAGE_BYTES]);
+			std::memcpy(pages[p].get(), a.pages[p].get(), PAGE_BYTES);
+		}
+	}
+
+	static inline Packing packingOf(const Primitive primtype) noexcept {
+		switch(primtype){
+			case Primitive::BOOLEAN: return Packing::BITS;
+			case Primitive::CHAR: return Packing::BYTES;
+			default: return Packing::NONE;
+		}
+	}
+	/* The bytes `size` elements take up when they're all allocated. */
+	static inline size_t storageSize(const Packing packing, const size_t size) noexcept {
+		switch(packing){
+			case Packing::BITS: return (size + 7) / 8;
+			case Packing::BYTES: return size;
+			default: return size * sizeof(EValue);
+		}
+	}
+	static inline uint8_t pageShift(const Packing packing) noexcept {
+		switch(packing){
+			case Packing::BITS: return 15; // 8 per byte
+			case Packing::BYTES: return 12;
+			default: return 9; // 8 bytes each
+		}
+	}
+	/* How much memory a new array of `size` elements takes up, for the memory limit. */
+	static inline size_t bytes(const Primitive primtype, const size_t size) noexcept {
+		const Packing packing = packingOf(primtype);
+		const size_t storage = storageSize(packing, size);
+		if(storage <= PAGED_FROM) return sizeof(EArray) + storage;
+		return sizeof(EArray) + (((size - 1) >> pageShift(packing)) + 1) * sizeof(void *);
+	}
+	inline size_t bytes() const noexcept {
+		return sizeof(EArray) + dense.size() + pages.size() * sizeof(void *) + page_count * PAGE_BYTES;
+	}
+	/* Whether writing to element `i` has to allocate a page first. */
+	inline bool needsPage(const size_t i) const noexcept {
+		return paged && pages[i >> shift] == nullptr;
+	}
+
+	inline EValue get(const size_t i) const noexcept {
+		if(!paged) return load(dense.data(), i);
+		const uint8_t *page = pages[i >> shift].get();
+		return page == nullptr ? fill : load(page, i & mask());
+	}
+	inline void set(const size_t i, const EValue val){
+		if(paged) store(page(i), i & mask(), val);
+		else store(dense.data(), i, val);
+	}
+	/* Only for unpacked arrays. */
+	inline EValue& at(const size_t i){
+		if(paged) return reinterpret_cast<EValue *>(page(i))[i & mask()];
+		return reinterpret_cast<EValue *>(dense.data())[i];
+	}
+	/* Moves the elements out of their packing, so they can be pointed to.
+	 * Only pages that were already allocated get allocated again. */
+	inline void unpack(){
+		if(packing == Packing::NONE) return;
+		EArray res(length, Packing::NONE, EValue()); // FALSE and '\0' are both 0
+		if(paged){
+			for(size_t p = 0; p < pages.size(); p++){
+				if(pages[p] == nullptr) continue;
+				const size_t end = std::min(length, (p + 1) << shift);
+				for(size_t i = p << shift; i < end; i++) res.set(i, get(i));
+			}
+		} else {
+			for(size_t i = 0; i < length; i++) res.set(i, get(i));
+		}
+		packing = Packing::NONE;
+		paged = res.paged;
+		shift = res.shift;
+		page_count = res.page_count;
+		fill = res.fill;
+		dense.swap(res.dense);
+		pages.swap(res.pages);
+	}
+private:
+	inline size_t mask() const noexcept { return (size_t(1) << shift) - 1; }
+	inline uint8_t *page(const size_t i){
+		std::unique_ptr<uint8_t[]>& p = pages[i >> shift];
+		if(p == nullptr){
+			p.reset(new uint8_t[PAGE_BYTES]());
+			fillIn(p.get(), size_t(1) << shift);
+			page_count++;
+		}
+		return p.get();
+	}
+	/* Sets the first `n` elements at `base` to `fill` (the packed ones are already 0). */
+	inline void fillIn(uint8_t *base, const size_t n) noexcept {
+		if(packing != Packing::NONE) return;
+		for(size_t i = 0; i < n; i++){
+			std::memcpy(base + i * sizeof(EValue), &fill, sizeof(EValue));
+		}
+	}
+	inline EValue load(const uint8_t *base, const size_t i) const noexcept {
+		switch(packing){
+			case Packing::BITS: return bool((base[i >> 3] >> (i & 7)) & 1);
+			case Packing::BYTES: return char(base[i]);
+			default:
+				{
+					EValue res;
+					std::memcpy(&res, base + i * sizeof(EValue), sizeof(EValue));
+					return res;
+				}
+		}
+	}
+	inline void store(uint8_t *base, const size_t i, const EValue val) noexcept {
+		switch(packing){
+			case Packing::BITS:
+				if(val.b) base[i >> 3] |= uint8_t(1 << (i & 7));
+				else base[i >> 3] &= uint8_t(~(1 << (i & 7)));
+				break;
+			case Packing::BYTES: base[i] = uint8_t(val.c); break;
+			default: std::memcpy(base + i * sizeof(EValue), &val, sizeof(EValue)); break;
+		}
+	}
 };
 
 
@@ -114,8 +395,10 @@ struct EFunc {
 		RUNTIME,
 		BUILTIN
 	} what;
-	void *func_loc = nullptr;
-	EFunc(uint_least8_t arity_, What what_, EType *types_, int64_t *ids_, void *func, EType ret_type_):
+	/* The FUNCTION Stmt<true> for RUNTIME, the wrapper for BUILTIN.
+	 * It's const since the same Program can be run by many Envs at once. */
+	const void *func_loc = nullptr;
+	EFunc(uint_least8_t arity_, What what_, EType *types_, int64_t *ids_, const void *func, EType ret_type_):
 		arity(arity_), types(types_), ids(ids_), ret_type(ret_type_), what(what_), func_loc(func) {}
 	EFunc(uint_least8_t arity_, What what_):
 		arity(arity_), types(new EType[arity]), ids(new int64_t[arity]), what(what_) {}
@@ -139,7 +422,7 @@ struct EFunc {
 			delete[] ids;
 		}
 	}
-	static inline EFunc make_builtin(uint_least8_t arity, EType *types, void *func, EType ret_type) {
+	static inline EFunc make_builtin(uint_least8_t arity, EType *types, const void *func, EType ret_type) {
 		return EFunc(arity, What::BUILTIN, types, nullptr, func, ret_type);
 	}
 };
@@ -0,0 +1,240 @@
+#ifndef VM_HPP
+#define VM_HPP
+
+#include <vector>
+#include "bytecode.hpp"
+#include "environment.hpp"
+
+/* Runs a Chunk made by the Compiler.
+ * The Env is only used for input/output and array allocation;
+ * the variables live on the VM's register stack. */
+class VM {
+	const Chunk& chunk;
+	Env& env;
+	struct Frame {
+		const Instr *ret_pc;
+		uint32_t base;
+	};
+	/* The same size as the tree-walker's.
+	 * It's never reallocated, since references can point into it,
+	 * and it's left uninitialized, so the pages are only touched when they're used. */
+	std::unique_ptr<EValue[]> stack;
+	std::vector<Frame> frames;
+	std::vector<EArray *> pinned; /* by REFIDX */
+	std::vector<EType> types; /* the runtime bounds for each array descriptor */
+	std::vector<uint8_t> declared; /* per global */
+	std::vector<uint8_t> defined; /* per function */
+
+	/* Makes sure a frame starting at `base` has room, and returns its registers. */
+	inline EValue *frame(uint32_t base, const Proto& proto){
+		if(Env::STACK_SIZE < static_cast<size_t>(base) + proto.frame_size){
+			throw RuntimeError("Stack overflow");
+		}
+		return stack.get() + base;
+	}
+	/* Where the element at the indexes starting at `idx` is in an array of `type`. */
+	static inline size_t offset(const EValue *idx, const EType& type){
+		return Env::offset(type, [idx](size_t i){ return idx[i].i64; });
+	}
+public:
+	inline VM(const Chunk& chunk_, Env& env_):
+		chunk(chunk_), env(env_), stack(new EValue[Env::STACK_SIZE]), types(chunk.descs.size()),
+		declared(chunk.global_count, 0), defined(chunk.protos.size(), 0)
+	{
+		env.useLiterals(chunk.strings);
+	}
+	inline void run();
+};
+
+inline void VM::run(){
+	const Instr * const code = chunk.code.data();
+	const Instr *pc = code + chunk.protos[0].entry;
+	uint32_t base = 0;
+	EValue *R = frame(base, chunk.protos[0]);
+	frames.clear();
+	for(;;){
+		const Instr& i = *pc++;
+		switch(i.op){
+#define CASE(x) case Op:: x
+			CASE(MOVE): R[i.a] = R[i.b]; break;
+			CASE(LOADK): R[i.a] = chunk.constants[i.b]; break;
+			CASE(GETGC):
+				if(!declared[i.b]) throw RuntimeError("Undefined variable");
+				[[fallthrough]];
+			CASE(GETG): R[i.a] = stack[i.b]; break;
+			CASE(SETGC):
+				if(!declared[i.a]) throw RuntimeError("Undefined variable");
+				[[fallthrough]];
+			CASE(SETG): stack[i.a] = R[i.b]; break;
+			CASE(DEFG): declared[i.a] = true; break;
+			CASE(GETR): R[i.a] = *R[i.b].ref; break;
+			CASE(SETR): *R[i.a].ref = R[i.b]; break;
+			CASE(REF): R[i.a].ref = &R[i.b]; break;
+			CASE(REFGC):
+				if(!declared[i.b]) throw RuntimeError("Undefined variable");
+				[[fallthrough]];
+			CASE(REFG): R[i.a].ref = &stack[i.b]; break;
+
+			// Arithmetic {{{
+			CASE(ADD_I): R[i.a] = R[i.b].i64 + R[i.c].i64; break;
+			CASE(SUB_I): R[i.a] = R[i.b].i64 - R[i.c].i64; break;
+			CASE(MUL_I): R[i.a] = R[i.b].i64 * R[i.c].i64; break;
+			CASE(DIV_I):
+				if(R[i.c].i64 == 0) throw RuntimeError("Cannot divide by zero");
+				R[i.a] = R[i.b].i64 / R[i.c].i64;
+				break;
+			CASE(MOD_I):
+				if(R[i.c].i64 == 0) throw RuntimeError("Cannot divide by zero");
+				R[i.a] = R[i.b].i64 % R[i.c].i64;
+				break;
+			CASE(ADD_R): R[i.a] = R[i.b].frac + R[i.c].frac; break;
+			CASE(SUB_R): R[i.a] = R[i.b].frac - R[i.c].frac; break;
+			CASE(MUL_R): R[i.a] = R[i.b].frac * R[i.c].frac; break;
+			CASE(DIV_R): R[i.a] = R[i.b].frac / R[i.c].frac; break;
+			CASE(NEG_I): R[i.a] = -R[i.b].i64; break;
+			CASE(NEG_R): R[i.a] = -R[i.b].frac; break;
+			CASE(NOT): R[i.a] = !R[i.b].b; break;
+			CASE(I2R): R[i.a] = Fraction<>(R[i.b].i64); break;
+			// }}}
+
+			// Comparisons {{{
+#define CMP(t, field) \
+			CASE(EQ_##t): R[i.a] = (R[i.b].field == R[i.c].field); break; \
+			CASE(NE_##t): R[i.a] = (R[i.b].field != R[i.c].field); break; \
+			CASE(LT_##t): R[i.a] = (R[i.b].field < R[i.c].field); break; \
+			CASE(LE_##t): R[i.a] = (R[i.b].field <= R[i.c].field); break;
+			CMP(I, i64)
+			CMP(R, frac)
+			CMP(C, c)
+			CMP(B, b)
+			CMP(S, str)
+			CMP(D, date)
+#undef CMP
+			// }}}
+
+			// Control flow {{{
+			/* Jumping backwards ends an iteration of a WHILE or REPEAT, so it's a step. */
+			CASE(JMP):
+				if(code + i.a < pc) env.step();
+				pc = code + i.a;
+				break;
+			CASE(JT): if(R[i.a].b) pc = code + i.b; break;
+			CASE(JF):
+				if(!R[i.a].b){
+					if(code + i.b < pc) env.step();
+					pc = code + i.b;
+				}
+				break;
+			/* The FOR loop works the same way as in Stmt::eval:
+			 * the direction is fixed by whether `from <= to`,
+			 * and going against the step is an error. */
+#define FORLOOP(suffix, field) \
+			CASE(FORPREP_##suffix): \
+				{ \
+					EValue *loop = &R[i.a]; \
+					if(((loop[0].field < loop[1].field) && (loop[2].field < 0)) \
+						|| ((loop[0].field > loop[1].field) && (loop[2].field > 0))){ \
+						throw RuntimeError("Cannot have a for loop that goes in the opposite direction to its step"); \
+					} \
+					loop[3].b = (loop[0].field <= loop[1].field); \
+					R[i.c] = loop[0]; \
+				} \
+				break; \
+			CASE(FORLOOP_##suffix): \
+				{ \
+					EValue *loop = &R[i.a]; \
+					env.step(); \
+					loop[0].field += loop[2].field; \
+					if(loop[3].b ? loop[0].field <= loop[1].field : loop[0].field >= loop[1].field){ \
+						R[i.c] = loop[0]; \
+						pc = code + i.b; \
+					} \
+				} \
+				break;
+			FORLOOP(I, i64)
+			FORLOOP(R, frac)
+#undef FORLOOP
+			CASE(CALL):
+				if(!defined[i.b]) throw RuntimeError("Cannot call non-function");
+				if(frames.size() >= Env::MAX_DEPTH) throw RuntimeError("Stack overflow");
+				env.step();
+				frames.push_back({ pc, base });
+				base += i.a;
+				R = frame(base, chunk.protos[i.b]);
+				pc = code + chunk.protos[i.b].entry;
+				break;
+			CASE(CALLB):
+				{
+					// a step, like any other call
+					env.step();
+					auto func_ptr = (EValue (*)(EValue *))chunk.builtins[i.b]->func_loc;
+					R[i.a] = func_ptr(&R[i.a]);
+				}
+				break;
+			CASE(RET):
+				R[0] = R[i.a];
+				[[fallthrough]];
+			CASE(RET0):
+				pc = frames.back().ret_pc;
+				base = frames.back().base;
+				frames.pop_back();
+				R = stack.get() + base;
+				break;
+			CASE(DEFFUN): defined[i.a] = true; break;
+			CASE(THROW):
+				if(i.a == 0) throw RuntimeError(chunk.messages[i.b]);
+				else throw TypeError(chunk.messages[i.b]);
+			CASE(LINE): env.profiler->line(i.a, i.b == 0); break;
+			CASE(HALT): return;
+			// }}}
+
+			// Arrays {{{
+			CASE(SETDESC):
+				{
+					EType& type = types[i.a];
+					type = EType(true, std::vector<std::pair<int64_t,int64_t>>(chunk.descs[i.a].rank), chunk.descs[i.a].primtype);
+					for(size_t d = 0; d < type.bounds.size(); d++){
+						type.bounds[d] = { R[i.b + 2*d].i64, R[i.b + 2*d + 1].i64 };
+					}
+				}
+				break;
+			CASE(NEWARR): env.allocVar(&R[i.a], types[i.b]); break;
+			CASE(CHKARR):
+				if(types[i.a] != types[i.b]){
+					throw TypeError("Bad type " + types[i.a].to_str() + ", expected " + types[i.b].to_str());
+				}
+				break;
+			CASE(COPYARR): env.copyValue(R[i.b], types[i.c], &R[i.a]); break;
+			CASE(RELEASE): env.release(R[i.a]); break;
+			CASE(SETARR): env.replace(R[i.a], R[i.b]); break;
+			CASE(GETIDX): R[i.a] = R[i.b].arr->get(offset(&R[i.c], types[i.d])); break;
+			CASE(SETIDX): env.setElement(R[i.a], offset(&R[i.b], types[i.d]), R[i.c]); break;
+			CASE(REFIDX):
+				{
+					EValue& elem = env.refElement(R[i.b], offset(&R[i.c], types[i.d]));
+					R[i.b].arr->pins++;
+					pinned.push_back(R[i.b].arr);
+					R[i.a].ref = &elem;
+				}
+				break;
+			CASE(UNPIN):
+				// only a damaged cache file could get this wrong
+				if(i.a > pinned.size()) throw RuntimeError("Invalid bytecode. (INTERNAL ERROR)");
+				for(uint32_t n = 0; n < i.a; n++){
+					env.unpin(pinned.back());
+					pinned.pop_back();
+				}
+				break;
+			// }}}
+
+			// I/O {{{
+			CASE(INPUT): env.input(R[i.a], static_cast<Primitive>(i.b)); break;
+			CASE(OUTPUT): env.output(R[i.a], static_cast<Primitive>(i.b)); break;
+			CASE(NEWLINE): env.out << '\n'; break;
+			// }}}
+#undef CASE
+		}
+	}
+}
+
+#endif /* VM_HPP */
@@ -2,6 +2,9 @@
 #include <filesystem>
 #define TESTS
 #include "../src/interpreter.hpp"
+#include "../src/compiler.hpp"
+#include "../src/vm.hpp"
+#include "../src/cache.hpp"
 
 namespace fs = std::filesystem;
 
@@ -24,11 +27,28 @@ std::string readFile(const std::string& filepath){
 	return cont;
 }
 
+/* Runs an already checked program either on the tree-walker or on the VM. */
+void exec(const TypeChecker& checker, const Parser& parser, Env& env, bool tree_walk){
+	if(tree_walk){
+		parser.run(env);
+	} else {
+		Compiler compiler(*parser.output, checker);
+		VM vm(compiler.output, env);
+		vm.run();
+	}
+}
+
+void run(Lexer& lex, Parser& parser, Env& env, bool tree_walk){
+	TypeChecker checker(*parser.output, lex.id_num);
+	exec(checker, parser, env, tree_walk);
+}
+
 
 TEST_CASE("INTERPRETING", "[interpreter]"){
+	for(const bool tree_walk : { true, false })
 	for(const auto& file : fs::directory_iterator("test/valid-files")){
 		const std::string name = file.path().filename().string();
-		INFO("File is " << name);
+		INFO("File is " << name << (tree_walk ? " (tree-walker)" : " (VM)"));
 		if(!endsWith(name, ".in.pcse")) continue; /* we don't want to look at this file */
 		
 		std::ifstream in(file.path().c_str(), std::ios::in);
@@ -37,7 +57,7 @@ TEST_CASE("INTERPRETING", "[interpreter]"){
 
 			Lexer lex(in);
 			Parser parser(lex.output);
-			Env env(lex.identifier_count, lex.id_num);
+			Env env;
 			std::string inpname = file.path().c_str();
 			// ".in.pcse" => ".in"
 			{
@@ -50,13 +70,15 @@ TEST_CASE("INTERPRETING", "[interpreter]"){
 					inpname[i + inpname.size() - out.size()] = out[i];
 				}
 			}
+			std::string inp;
 			try {
-				const std::string inp = readFile(inpname);
+				inp = readFile(inpname);
 				env.in = std::istringstream(inp);
 			} catch(std::runtime_error& e){
 				// no input
 			}
-			parser.run(env);
+			TypeChecker checker(*parser.output, lex.id_num);
+			exec(checker, parser, env, tree_walk);
 
 			std::string outname = file.path().c_str();
 			
@@ -73,11 +95,31 @@ TEST_CASE("INTERPRETING", "[interpreter]"){
 			}
 			const std::string correct = readFile(outname);
 			REQUIRE(env.out.str() == correct);
+
+			/* nothing in the program changes when it runs, so running it again gives the same thing */
+			Env again;
+			again.in = std::istringstream(inp);
+			exec(checker, parser, again, tree_walk);
+			REQUIRE(again.out.str() == correct);
+
+			/* and the compiled form works the same after going through the cache */
+			if(!tree_walk){
+				const std::string src = readFile(file.path().c_str());
+				Compiler compiler(*parser.output, checker);
+				Chunk cached;
+				REQUIRE(cache::deserialize(cache::serialize(compiler.output, src), src, cached));
+				Env from_cache;
+				from_cache.in = std::istringstream(inp);
+				VM vm(cached, from_cache);
+				vm.run();
+				REQUIRE(from_cache.out.str() == correct);
+			}
 		}
 	}
+	for(const bool tree_walk : { true, false })
 	for(const auto& file : fs::directory_iterator("test/invalid-files")){
 		const std::string name = file.path().filename().string();
-		INFO("File is " << name);
+		INFO("File is " << name << (tree_walk ? " (tree-walker)" : " (VM)"));
 		if(!endsWith(name, ".in.pcse")) continue; /* we don't want to look at this file */
 
 		std::ifstream in(file.path().c_str(), std::ios::in);
@@ -101,10 +143,241 @@ TEST_CASE("INTERPRETING", "[interpreter]"){
 			try {
 				Lexer lex(in);
 				Parser parser(lex.output);
-				Env env(lex.identifier_count, lex.id_num);
-				parser.run(env);
+				Env env;
+				run(lex, parser, env, tree_walk);
 			} CATCH(LexError) CATCH(ParseError) CATCH(TypeError) CATCH(RuntimeError);
 			REQUIRE(errmsg == correct);
 		}
 	}
 }
+
+/* Runs `src` with `limits`, and returns the name of what it threw ("" if nothing). */
+std::string runLimited(const std::string& src, const Env::Limits& limits, bool tree_walk){
+	Lexer lex(src);
+	Parser parser(lex.output);
+	Env env;
+	env.setLimits(limits);
+	try {
+		run(lex, parser, env, tree_walk);
+	} catch(StepLimitError&){
+		return "StepLimitError";
+	} catch(MemoryLimitError&){
+		return "MemoryLimitError";
+	} catch(TimeLimitError&){
+		return "TimeLimitError";
+	}
+	return "";
+}
+
+TEST_CASE("CACHE", "[interpreter]"){
+	/* the same length, so if their hashes ever collided they'd have the same file */
+	const std::string a = "OUTPUT 1\n", b = "OUTPUT 2\n";
+	Lexer lex(a);
+	Parser parser(lex.output);
+	TypeChecker checker(*parser.output, lex.id_num);
+	Compiler compiler(*parser.output, checker);
+	const std::string data = cache::serialize(compiler.output, a);
+	Chunk chunk;
+	REQUIRE(cache::deserialize(data, a, chunk));
+	Chunk other;
+	REQUIRE(!cache::deserialize(data, b, other));
+	/* a damaged file is a miss, wherever it was cut off */
+	for(size_t n = 0; n < data.size(); n++){
+		Chunk cut;
+		REQUIRE(!cache::deserialize(std::string_view(data).substr(0, n), a, cut));
+	}
+	/* and so is one that would use a register past the end of the frame, or jump out of the code */
+	const Instr first = compiler.output.code[0];
+	compiler.output.code[0].a = compiler.output.protos[0].frame_size;
+	Chunk bad_reg;
+	REQUIRE(!cache::deserialize(cache::serialize(compiler.output, a), a, bad_reg));
+	compiler.output.code[0] = Instr(Op::JMP, compiler.output.code.size());
+	Chunk bad_jump;
+	REQUIRE(!cache::deserialize(cache::serialize(compiler.output, a), a, bad_jump));
+	compiler.output.code[0] = first;
+	Chunk good;
+	REQUIRE(cache::deserialize(cache::serialize(compiler.output, a), a, good));
+#ifdef PCSE_HAVE_MMAP
+	/* only files that nobody else could have written are read */
+	char tmpl[] = "/tmp/pcse-cache-XXXXXX";
+	const std::string dir = mkdtemp(tmpl);
+	const std::string file = cache::path(dir, a);
+	cache::store(file, compiler.output, a);
+	Chunk stored;
+	REQUIRE(cache::load(file, a, stored));
+	chmod(file.c_str(), 0666);
+	REQUIRE(!cache::load(file, a, stored));
+	chmod(file.c_str(), 0644);
+	const std::string link = dir + "/link.pcsec";
+	REQUIRE(symlink(file.c_str(), link.c_str()) == 0);
+	REQUIRE(!cache::load(link, a, stored));
+	chmod(dir.c_str(), 0777);
+	REQUIRE(!cache::load(file, a, stored));
+	/* and nothing is written where it wouldn't be read */
+	const std::string other_file = cache::path(dir, b);
+	cache::store(other_file, compiler.output, b);
+	chmod(dir.c_str(), 0700);
+	REQUIRE(!cache::load(other_file, b, stored));
+	REQUIRE(cache::load(file, a, stored));
+	unlink(link.c_str());
+	unlink(file.c_str());
+	rmdir(dir.c_str());
+#endif
+}
+
+TEST_CASE("LIMITS", "[interpreter]"){
+	const std::string forever = "DECLARE x : INTEGER\nx <- 0\nWHILE TRUE DO\n\tx <- x + 1\nENDWHILE\n";
+	/* 10 FOR steps, 5 WHILE steps and 3 calls */
+	const std::string counted =
+		"PROCEDURE p\n\tOUTPUT 1\nENDPROCEDURE\n"
+		"DECLARE x : INTEGER\nx <- 0\n"
+		"FOR i <- 1 TO 10\n\tx <- x + i\nNEXT\n"
+		"WHILE x > 50 DO\n\tx <- x - 1\nENDWHILE\n"
+		"CALL p\nCALL p\nCALL p\n";
+	/* builtins are calls too: 10 FOR steps and 10 calls */
+	const std::string builtins = "DECLARE x : INTEGER\nFOR i <- 1 TO 10\n\tx <- INT(1.5)\nNEXT\n";
+	/* 2^32 * 2^32 elements don't fit in a size_t */
+	const std::string huge = "DECLARE a : ARRAY[1:4294967296] OF ARRAY[1:4294967296] OF INTEGER\n";
+	/* 2^61 elements fit, but not 2^64 bytes of them */
+	const std::string too_many_bytes = "DECLARE a : ARRAY[1:1048576 * 1048576 * 2097152] OF INTEGER\n";
+	/* big arrays are only allocated as they're written to */
+	const std::string big = "DECLARE a : ARRAY[1:1000000] OF INTEGER\nFOR i <- 1 TO 1000000\n\ta[i] <- i\nNEXT\n";
+	const std::string sparse =
+		"DECLARE a : ARRAY[1:100000000] OF INTEGER\n"
+		"a[1] <- 1\na[100000000] <- 2\nOUTPUT a[1] + a[50000000] + a[100000000]\n";
+	/* packed, so these are 1.25MB and 1MB */
+	const std::string flags = "DECLARE a : ARRAY[1:10000000] OF BOOLEAN\nFOR i <- 1 TO 10000000 STEP 1000\n\ta[i] <- TRUE\nNEXT\n";
+	const std::string chars = "DECLARE a : ARRAY[1:1000000] OF CHAR\na[1] <- 'x'\n";
+	for(const bool tree_walk : { true, false }){
+		INFO((tree_walk ? "tree-walker" : "VM"));
+		REQUIRE(runLimited(forever, { 1000, 0, 0 }, tree_walk) == "StepLimitError");
+		REQUIRE(runLimited(forever, { 0, 0, 0.05 }, tree_walk) == "TimeLimitError");
+		REQUIRE(runLimited(counted, { 17, 0, 0 }, tree_walk) == "StepLimitError");
+		REQUIRE(runLimited(counted, { 18, 0, 0 }, tree_walk) == "");
+		REQUIRE(runLimited(builtins, { 15, 0, 0 }, tree_walk) == "StepLimitError");
+		REQUIRE(runLimited(builtins, { 20, 0, 0 }, tree_walk) == "");
+		REQUIRE_THROWS_AS(runLimited(huge, { 0, 10000000, 0 }, tree_walk), RuntimeError);
+		REQUIRE_THROWS_AS(runLimited(too_many_bytes, { 0, 10000000, 0 }, tree_walk), RuntimeError);
+		REQUIRE(runLimited(big, { 0, 1000000, 0 }, tree_walk) == "MemoryLimitError");
+		REQUIRE(runLimited(big, { 0, 100000000, 0 }, tree_walk) == "");
+		REQUIRE(runLimited(sparse, { 0, 2000000, 0 }, tree_walk) == "");
+		REQUIRE(runLimited(flags, { 0, 2000000, 0 }, tree_walk) == "");
+		REQUIRE(runLimited(flags, { 0, 1000000, 0 }, tree_walk) == "MemoryLimitError");
+		REQUIRE(runLimited(chars, { 0, 2000000, 0 }, tree_walk) == "");
+	}
+}
+
+TEST_CASE("RECLAIMING", "[interpreter]"){
+	/* every iteration makes new 800KB arrays, but only a few are ever live at once */
+	const std::string src =
+		"DECLARE a : ARRAY[1:100000] OF INTEGER\n"
+		"DECLARE b : ARRAY[1:100000] OF INTEGER\n"
+		"FUNCTION Bump(x : ARRAY[1:100000] OF INTEGER) RETURNS ARRAY[1:100000] OF INTEGER\n"
+		"\tx[1] <- x[1] + 1\n\tRETURN x\nENDFUNCTION\n"
+		"FUNCTION Same(x : ARRAY[1:100000] OF INTEGER) RETURNS ARRAY[1:100000] OF INTEGER\n"
+		"\tRETURN x\nENDFUNCTION\n"
+		"FOR i <- 1 TO 200\n"
+		"\ta <- Bump(a)\n\tb <- a\n\tb[2] <- i\n\ta <- Same(Bump(b))\n\tCALL Bump(a)\n"
+		"NEXT\n"
+		"OUTPUT a[1], \" \", a[2], \" \", b[1]\n";
+	for(const bool tree_walk : { true, false }){
+		INFO((tree_walk ? "tree-walker" : "VM"));
+		Lexer lex(src);
+		Parser parser(lex.output);
+		Env env;
+		env.setLimits({ 0, 4000000, 0 });
+		run(lex, parser, env, tree_walk);
+		REQUIRE(env.out.str() == "400 200 399\n");
+		// just `a` and `b` are left
+		const Env::MemoryStats stats = env.memoryStats();
+		REQUIRE(stats.arrays == 2);
+		REQUIRE(stats.live_bytes == 2 * EArray::bytes(Primitive::INTEGER, 100000));
+		REQUIRE(stats.peak_bytes <= 3 * EArray::bytes(Primitive::INTEGER, 100000));
+	}
+}
+
+TEST_CASE("PROFILER", "[interpreter]"){
+	const std::string src =
+		"FUNCTION sq(x : INTEGER) RETURNS INTEGER\n" // 1
+		"\tRETURN x * x\n"
+		"ENDFUNCTION\n"
+		"DECLARE total : INTEGER\n"
+		"total <- 0\n" // 5
+		"FOR i <- 1 TO 10\n"
+		"\ttotal <- total + sq(i)\n"
+		"\tIF i MOD 5 = 0 THEN\n"
+		"\t\ttotal <- total - 1\n"
+		"\tENDIF\n" // 10
+		"NEXT\n"
+		"OUTPUT total\n";
+	const uint64_t counts[] = { 0, 1, 10, 0, 1, 1, 1, 10, 10, 2, 0, 0, 1 };
+	for(const bool tree_walk : { true, false }){
+		INFO((tree_walk ? "tree-walker" : "VM"));
+		Lexer lex(src);
+		Parser parser(lex.output);
+		TypeChecker checker(*parser.output, lex.id_num);
+		Env env;
+		Profiler profiler;
+		env.profiler = &profiler;
+		if(tree_walk){
+			parser.run(env);
+		} else {
+			Compiler compiler(*parser.output, checker, true);
+			VM vm(compiler.output, env);
+			vm.run();
+		}
+		REQUIRE(env.out.str() == "383\n");
+		for(size_t n = 1; n < std::size(counts); n++){
+			INFO("Line " << n);
+			REQUIRE(profiler.count(n) == counts[n]);
+		}
+	}
+}
+
+TEST_CASE("INPUT BUFFER", "[interpreter]"){
+	const std::vector<std::string> lines = { "", "a", "abc", "abcdefghij", "", "xyz", "a much longer line than the chunk", "last" };
+	std::string text;
+	for(const auto& line : lines) text += line + '\n';
+	text.pop_back(); // no newline at the end
+	/* a tiny chunk, so lines are split across refills and longer than a chunk */
+	for(const size_t chunk_size : { 1, 4, 7, 1 << 16 }){
+		INFO("Chunk size is " << chunk_size);
+		std::istringstream in(text);
+		InBuffer reader(in, chunk_size);
+		std::string_view line;
+		for(size_t i = 0; i < lines.size(); i++){
+			REQUIRE(reader.line(line));
+			REQUIRE(line == lines[i]);
+		}
+		REQUIRE(!reader.line(line));
+	}
+	/* STRINGs are copied out of the buffer, so they stay the same after it's reused */
+	Lexer lex("DECLARE a : STRING\nDECLARE b : STRING\nDECLARE c : STRING\nINPUT a\nINPUT b\nINPUT c\nOUTPUT a, b, c\n");
+	Parser parser(lex.output);
+	for(const bool tree_walk : { true, false }){
+		Env env;
+		env.in = std::istringstream(std::string(1 << 17, 'x') + "\nyy\nzzz\n");
+		run(lex, parser, env, tree_walk);
+		REQUIRE(env.out.str() == std::string(1 << 17, 'x') + "yyzzz\n");
+	}
+}
+
+TEST_CASE("LEXER LIFETIME", "[interpreter]"){
+	/* the Program and the Chunk keep their own copies of the string literals, so the Lexer can go first */
+	auto lex = std::make_unique<Lexer>("DECLARE s : STRING\nINPUT s\nIF s = \"abc\" THEN\n\tOUTPUT \"same \", s\nENDIF\n");
+	Parser parser(lex->output);
+	TypeChecker checker(*parser.output, lex->id_num);
+	Compiler compiler(*parser.output, checker);
+	lex.reset();
+	for(const bool tree_walk : { true, false }){
+		Env env;
+		env.in = std::istringstream("abc\n");
+		if(tree_walk){
+			parser.run(env);
+		} else {
+			VM vm(compiler.output, env);
+			vm.run();
+		}
+		REQUIRE(env.out.str() == "same abc\n");
+	}
+}
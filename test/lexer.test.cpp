@@ -77,6 +77,13 @@ TEST_CASE("Lexing", "[lex]"){
 			REQUIRE(lex.output[i].literal.i64 == 0);
 		}
 	}
+	for(const auto& r : reserved_words){
+		INFO("Word is " << r.word);
+		REQUIRE(reservedWordType(r.word) == r.type);
+		// prefixes and extensions of reserved words are just identifiers
+		REQUIRE(reservedWordType(r.word.substr(0, r.word.size() - 1)) != r.type);
+		REQUIRE(reservedWordType(std::string(r.word) + "_") == TokenType::IDENTIFIER);
+	}
 	{
 		/* When I first wrote this test.
 		 * I wrote "21/20/2019".
@@ -107,13 +114,30 @@ TEST_CASE("Lexing", "[lex]"){
 		// read file
 		std::ifstream in(file.path().c_str(), std::ios::in);
 
+		std::stringstream contents;
+		contents << in.rdbuf();
+		const std::string src = contents.str();
+
 		// test it
 		bool failed = false;
 		try {
-			Lexer tmp(in);
+			std::istringstream inp(src);
+			Lexer tmp(inp);
+			// lexing straight from a buffer should give the same tokens
+			Lexer from_buf(std::string_view{src});
+			REQUIRE(from_buf.output == tmp.output);
 		} catch(LexError& e){
 			failed = true;
 			UNSCOPED_INFO("Error is " << e.what());
+			try {
+				Lexer from_buf(std::string_view{src});
+				FAIL("Lexing from a buffer didn't fail");
+			} catch(LexError& e2){
+				REQUIRE(std::string(e2.what()) == e.what());
+				REQUIRE(e2.pos == e.pos);
+				REQUIRE(e2.line == e.line);
+				REQUIRE(e2.col == e.col);
+			}
 		}
 		REQUIRE(should_pass != failed);
 	}
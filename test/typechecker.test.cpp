@@ -0,0 +1,36 @@
+#include <catch2/catch.hpp>
+#define TESTS
+#include "../src/typechecker.hpp"
+
+TEST_CASE("Type checking", "[typechecker]"){
+
+	{
+		std::istringstream inp("DECLARE x: REAL\nx <- 1 + 2 * 3.5\nOUTPUT x > 2");
+		Lexer lex(inp);
+		Parser parser(lex.output);
+		TypeChecker checker(*parser.output, lex.id_num);
+		Program& p = *parser.output;
+		REQUIRE(p.stmts[1].lvalues[0].type == Primitive::REAL);
+		REQUIRE(p.stmts[1].exprs[0].type == Primitive::REAL);
+		REQUIRE(p.stmts[1].exprs[0].left->type == Primitive::INTEGER);
+		REQUIRE(p.stmts[1].exprs[0].right->type == Primitive::REAL);
+		REQUIRE(p.stmts[2].exprs[0].type == Primitive::BOOLEAN);
+	}
+
+	{
+		// Errors are found even in code that would never run.
+		std::istringstream inp("IF FALSE THEN\nOUTPUT 1 + TRUE\nENDIF");
+		Lexer lex(inp);
+		Parser parser(lex.output);
+		REQUIRE_THROWS_WITH(TypeChecker(*parser.output, lex.id_num), "Invalid type applied to math expression");
+	}
+
+	{
+		std::istringstream inp("DECLARE arr: ARRAY[1:2] OF ARRAY[1:3] OF CHAR\nOUTPUT arr[1][2]");
+		Lexer lex(inp);
+		Parser parser(lex.output);
+		TypeChecker checker(*parser.output, lex.id_num);
+		Program& p = *parser.output;
+		REQUIRE(p.stmts[1].exprs[0].type == Primitive::CHAR);
+	}
+}